@@ -0,0 +1,200 @@
+//
+// Copyright Aliaksei Levin (levlam@telegram.org), Arseny Smirnov (arseny30@gmail.com) 2014-2025
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#include "td/db/binlog/Binlog.h"
+#include "td/db/binlog/BinlogEvent.h"
+#include "td/db/TQueue.h"
+
+#include "td/utils/common.h"
+#include "td/utils/logging.h"
+#include "td/utils/port/path.h"
+#include "td/utils/port/Stat.h"
+#include "td/utils/Random.h"
+#include "td/utils/Slice.h"
+#include "td/utils/Span.h"
+#include "td/utils/Time.h"
+
+#include <memory>
+#include <utility>
+
+// Drives td::TQueue with a td::TQueueBinlog storage in the same way as the Bot API server does
+// and reports push, get, forget and garbage collection throughput, memory per event and startup replay time.
+// Usage: bench_tqueue [binlog_path]
+
+namespace {
+
+constexpr td::int32 START_UNIX_TIME = 1000000000;
+constexpr td::int32 MAX_EXPIRE_DELAY = 86400;
+constexpr std::size_t UPDATE_SIZE = 300;
+constexpr std::size_t GET_LIMIT = 100;
+
+struct Workload {
+  td::Slice name;
+  td::int32 queue_count;
+  td::int32 events_per_queue;
+  td::int32 hot_queue_count;  // queues, which receive a half of all events
+  bool has_mixed_expiry;
+};
+
+td::int64 get_resident_size() {
+  auto r_mem_stat = td::mem_stat();
+  if (r_mem_stat.is_error()) {
+    return 0;
+  }
+  return static_cast<td::int64>(r_mem_stat.ok().resident_size_);
+}
+
+void print_result(td::Slice workload, td::Slice key, double value) {
+  LOG(PLAIN) << workload << '\t' << key << '\t' << value;
+}
+
+void print_rate(td::Slice workload, td::Slice key, td::int64 count, double time) {
+  print_result(workload, key, time > 0 ? static_cast<double>(count) / time : 0.0);
+}
+
+void run_workload(const Workload &workload, td::CSlice binlog_path) {
+  td::unlink(binlog_path).ignore();
+
+  auto binlog = std::make_shared<td::Binlog>();
+  binlog->init(binlog_path.str(), [](const td::BinlogEvent &) {}).ensure();
+  auto tqueue_binlog = td::make_unique<td::TQueueBinlog<td::Binlog>>();
+  tqueue_binlog->set_binlog(binlog);
+  auto tqueue = td::TQueue::create();
+  tqueue->set_callback(std::move(tqueue_binlog));
+
+  auto get_queue_id = [&](td::int64 i) -> td::TQueue::QueueId {
+    if (workload.hot_queue_count > 0 && i % 2 == 0) {
+      return td::Random::fast(1, workload.hot_queue_count);
+    }
+    return td::Random::fast(1, workload.queue_count);
+  };
+  auto get_expires_at = [&] {
+    if (workload.has_mixed_expiry) {
+      return START_UNIX_TIME + td::Random::fast(60, MAX_EXPIRE_DELAY);
+    }
+    return START_UNIX_TIME + MAX_EXPIRE_DELAY;
+  };
+
+  td::string data(UPDATE_SIZE, 'a');
+  auto total_event_count = static_cast<td::int64>(workload.queue_count) * workload.events_per_queue;
+  auto start_resident_size = get_resident_size();
+
+  auto start_time = td::Time::now();
+  for (td::int64 i = 0; i < total_event_count; i++) {
+    tqueue->push(get_queue_id(i), data, get_expires_at(), 0, td::TQueue::EventId()).ensure();
+  }
+  print_rate(workload.name, "push_per_second", total_event_count, td::Time::now() - start_time);
+  print_result(workload.name, "memory_per_event",
+               static_cast<double>(get_resident_size() - start_resident_size) / static_cast<double>(total_event_count));
+
+  td::vector<td::TQueue::Event> event_buffer(GET_LIMIT);
+  td::int64 received_event_count = 0;
+  start_time = td::Time::now();
+  for (td::TQueue::QueueId queue_id = 1; queue_id <= workload.queue_count; queue_id++) {
+    auto from = tqueue->get_head(queue_id);
+    while (!from.empty()) {
+      td::MutableSpan<td::TQueue::Event> events(event_buffer);
+      tqueue->get(queue_id, from, false, START_UNIX_TIME, events).ensure();
+      if (events.empty()) {
+        break;
+      }
+      received_event_count += static_cast<td::int64>(events.size());
+      from = events.back().id.next().move_as_ok();
+    }
+  }
+  print_rate(workload.name, "get_events_per_second", received_event_count, td::Time::now() - start_time);
+
+  // restart with replay of the binlog as on the server startup and continue to work with the replayed queue
+  tqueue->extract_callback();
+  tqueue.reset();
+  binlog->close().ensure();
+  binlog = std::make_shared<td::Binlog>();
+  tqueue = td::TQueue::create();
+  td::int64 replayed_event_count = 0;
+  {
+    td::TQueueBinlog<td::Binlog> replay_tqueue_binlog;
+    start_time = td::Time::now();
+    binlog
+        ->init(binlog_path.str(),
+               [&](const td::BinlogEvent &event) {
+                 if (replay_tqueue_binlog.replay(event, *tqueue).is_ok()) {
+                   replayed_event_count++;
+                 }
+               })
+        .ensure();
+  }
+  auto replay_time = td::Time::now() - start_time;
+  print_result(workload.name, "replayed_events", static_cast<double>(replayed_event_count));
+  if (replayed_event_count > 0) {
+    print_result(workload.name, "replay_time_per_million_events",
+                 replay_time * 1e6 / static_cast<double>(replayed_event_count));
+  }
+  tqueue_binlog = td::make_unique<td::TQueueBinlog<td::Binlog>>();
+  tqueue_binlog->set_binlog(binlog);
+  tqueue->set_callback(std::move(tqueue_binlog));
+
+  // collect garbage in the middle of the expiration interval like the server does, in small steps
+  auto gc_unix_time = START_UNIX_TIME + MAX_EXPIRE_DELAY / 2;
+  td::int64 deleted_event_count = 0;
+  td::int64 gc_count = 0;
+  double gc_total_time = 0.0;
+  double gc_max_time = 0.0;
+  while (true) {
+    auto gc_start_time = td::Time::now();
+    auto result = tqueue->run_gc(gc_unix_time);
+    auto gc_time = td::Time::now() - gc_start_time;
+    gc_count++;
+    gc_total_time += gc_time;
+    gc_max_time = td::max(gc_max_time, gc_time);
+    deleted_event_count += result.first;
+    if (result.second) {
+      break;
+    }
+  }
+  print_result(workload.name, "gc_deleted_events", static_cast<double>(deleted_event_count));
+  print_result(workload.name, "gc_average_pause", gc_total_time / static_cast<double>(gc_count));
+  print_result(workload.name, "gc_max_pause", gc_max_time);
+
+  td::int64 forgotten_event_count = 0;
+  start_time = td::Time::now();
+  for (td::TQueue::QueueId queue_id = 1; queue_id <= workload.queue_count; queue_id++) {
+    auto from = tqueue->get_head(queue_id);
+    while (!from.empty()) {
+      td::MutableSpan<td::TQueue::Event> events(event_buffer);
+      tqueue->get(queue_id, from, false, gc_unix_time, events).ensure();
+      if (events.empty()) {
+        break;
+      }
+      for (auto &event : events) {
+        tqueue->forget(queue_id, event.id);
+      }
+      forgotten_event_count += static_cast<td::int64>(events.size());
+      from = events.back().id.next().move_as_ok();
+    }
+  }
+  print_rate(workload.name, "forget_per_second", forgotten_event_count, td::Time::now() - start_time);
+
+  tqueue->extract_callback();
+  tqueue.reset();
+  binlog->close().ensure();
+  td::unlink(binlog_path).ignore();
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  SET_VERBOSITY_LEVEL(VERBOSITY_NAME(ERROR));
+
+  td::string binlog_path = argc > 1 ? td::string(argv[1]) : td::string("bench_tqueue.binlog");
+
+  const Workload workloads[] = {{"many_small_queues", 100000, 10, 0, false},
+                                {"hot_queues", 1000, 1000, 10, false},
+                                {"mixed_expiry", 10000, 100, 100, true}};
+  for (auto &workload : workloads) {
+    run_workload(workload, binlog_path);
+  }
+  return 0;
+}
@@ -15,6 +15,7 @@
 
 #include "td/utils/algorithm.h"
 #include "td/utils/base64.h"
+#include "td/utils/crypto.h"
 #include "td/utils/emoji.h"
 #include "td/utils/filesystem.h"
 #include "td/utils/HttpUrl.h"
@@ -32,6 +33,7 @@
 #include "td/utils/Time.h"
 #include "td/utils/utf8.h"
 
+#include <algorithm>
 #include <cstdlib>
 
 namespace telegram_bot_api {
@@ -430,14 +432,34 @@ class Client::JsonDatedFiles final : public td::Jsonable {
   const Client *client_;
 };
 
+// serializes a cached short form of an object; unlike td::json_encode, doesn't take a buffer from the StackAllocator,
+// because it is called while an outer object is serialized and the outer buffer is still allocated
+template <class T>
+static td::string json_encode_cache(const T &object) {
+  char buf[1024];
+  td::JsonBuilder jb(td::StringBuilder(td::MutableSlice(buf, sizeof(buf)), true));
+  jb.enter_value() << object;
+  return jb.string_builder().as_cslice().str();
+}
+
 class Client::JsonUser final : public td::Jsonable {
  public:
   JsonUser(int64 user_id, const Client *client, bool full_bot_info = false)
       : user_id_(user_id), client_(client), full_bot_info_(full_bot_info) {
   }
   void store(td::JsonValueScope *scope) const {
-    auto object = scope->enter_object();
     auto user_info = client_->get_user_info(user_id_);
+    if (use_cache_ && !full_bot_info_ && user_info != nullptr) {
+      // the short form is serialized once and reused until the user is changed
+      if (user_info->json_cache.empty()) {
+        user_info->json_cache = json_encode_cache(JsonUser(user_id_, client_, NoCache()));
+        client_->json_cache_bytes_ += user_info->json_cache.size();
+      }
+      *scope << td::JsonRaw(user_info->json_cache);
+      return;
+    }
+
+    auto object = scope->enter_object();
     object("id", user_id_);
     bool is_bot = user_info != nullptr && user_info->type == UserInfo::Type::Bot;
     object("is_bot", td::JsonBool(is_bot));
@@ -468,9 +490,15 @@ class Client::JsonUser final : public td::Jsonable {
   }
 
  private:
+  struct NoCache {};
+  JsonUser(int64 user_id, const Client *client, NoCache)
+      : user_id_(user_id), client_(client), full_bot_info_(false), use_cache_(false) {
+  }
+
   int64 user_id_;
   const Client *client_;
   bool full_bot_info_;
+  bool use_cache_ = true;
 };
 
 class Client::JsonUsers final : public td::Jsonable {
@@ -1053,6 +1081,16 @@ class Client::JsonChat final : public td::Jsonable {
   void store(td::JsonValueScope *scope) const {
     auto chat_info = client_->get_chat(chat_id_);
     CHECK(chat_info != nullptr);
+    if (use_cache_ && !is_full_) {
+      // the short form is serialized once and reused until the chat or the corresponding user or supergroup is changed
+      if (chat_info->json_cache.empty()) {
+        chat_info->json_cache = json_encode_cache(JsonChat(chat_id_, client_, NoCache()));
+        client_->json_cache_bytes_ += chat_info->json_cache.size();
+      }
+      *scope << td::JsonRaw(chat_info->json_cache);
+      return;
+    }
+
     auto object = scope->enter_object();
     object("id", chat_id_);
     const td_api::chatPhoto *photo = nullptr;
@@ -1328,10 +1366,16 @@ class Client::JsonChat final : public td::Jsonable {
   }
 
  private:
+  struct NoCache {};
+  JsonChat(int64 chat_id, const Client *client, NoCache)
+      : chat_id_(chat_id), client_(client), is_full_(false), pinned_message_id_(-1), use_cache_(false) {
+  }
+
   int64 chat_id_;
   const Client *client_;
   bool is_full_;
   int64 pinned_message_id_;
+  bool use_cache_ = true;
 };
 
 class Client::JsonGiftBackground final : public td::Jsonable {
@@ -5515,6 +5559,49 @@ class Client::JsonUpdateTypes final : public td::Jsonable {
   td::uint32 update_types_;
 };
 
+class Client::JsonWebhookDeliveryStatistics final : public td::Jsonable {
+ public:
+  explicit JsonWebhookDeliveryStatistics(BotStatActor *stat) : stat_(stat) {
+  }
+  void store(td::JsonValueScope *scope) const {
+    auto object = scope->enter_object();
+    auto now = td::Time::now();
+    const auto &state = stat_->get_webhook_state();
+    object("open_connection_count", state.connection_count_);
+    object("idle_connection_count", state.idle_connection_count_);
+    object("connecting_count", state.connecting_count_);
+    object("in_flight_update_count", state.in_flight_update_count_);
+    object("loaded_update_count", state.loaded_update_count_);
+    if (state.oldest_update_load_time_ > 0) {
+      object("oldest_update_time_since_load", now - state.oldest_update_load_time_);
+    }
+
+    // the number of events during the last minute
+    auto stat = stat_->get_minute_stat(now);
+    object("delivered_update_count", get_minute_count(stat.webhook_update_count_));
+    if (stat.webhook_update_count_ > 0) {
+      object("average_delivery_time", stat.webhook_delivery_time_ / stat.webhook_update_count_);
+    }
+    for (std::size_t i = 0; i < ServerBotStat::WEBHOOK_LATENCY_BUCKET_COUNT; i++) {
+      td::Slice name = ServerBotStat::get_webhook_latency_bucket_name(i);
+      object(name.substr(td::Slice("webhook_").size()), get_minute_count(stat.webhook_latency_counts_[i]));
+    }
+    for (std::size_t i = 0; i < static_cast<std::size_t>(ServerBotStat::WebhookRetryCause::Size); i++) {
+      object(PSLICE() << "retry_count_" << ServerBotStat::get_webhook_retry_cause_name(i),
+             get_minute_count(stat.webhook_retry_counts_[i]));
+    }
+    object("sent_bytes", get_minute_count(stat.webhook_sent_bytes_));
+  }
+
+ private:
+  BotStatActor *stat_;
+
+  // minute statistics are normalized to events per second
+  static td::int64 get_minute_count(double rate) {
+    return static_cast<td::int64>(rate * 60 + 0.5);
+  }
+};
+
 class Client::JsonWebhookInfo final : public td::Jsonable {
  public:
   explicit JsonWebhookInfo(const Client *client) : client_(client) {
@@ -5550,6 +5637,9 @@ class Client::JsonWebhookInfo final : public td::Jsonable {
     if (client_->last_synchronization_error_date_ > 0) {
       object("last_synchronization_error_date", client_->last_synchronization_error_date_);
     }
+    if (!url.empty() && !client_->stat_actor_.empty()) {
+      object("delivery_statistics", JsonWebhookDeliveryStatistics(client_->stat_actor_.get_actor_unsafe()));
+    }
   }
 
  private:
@@ -7445,6 +7535,40 @@ ServerBotInfo Client::get_bot_info() const {
   res.webhook_max_connections_ = webhook_max_connections_;
   res.pending_update_count_ = tqueue->get_size(tqueue_id_);
   res.start_time_ = start_time_;
+  res.reply_markup_cache_hit_count_ = reply_markup_cache_hit_count_;
+  res.reply_markup_cache_miss_count_ = reply_markup_cache_miss_count_;
+  return res;
+}
+
+ServerBotMemoryUsage Client::get_memory_usage() const {
+  // rough estimates of the memory used by hash table entries and objects referenced by cached values
+  constexpr std::size_t HASH_TABLE_ENTRY_SIZE = 32;
+  constexpr std::size_t MESSAGE_CONTENT_SIZE = 256;
+  constexpr std::size_t USER_EXTRA_SIZE = 64;
+  constexpr std::size_t CHAT_EXTRA_SIZE = 64;
+  constexpr std::size_t GROUP_EXTRA_SIZE = 128;
+  constexpr std::size_t SUPERGROUP_EXTRA_SIZE = 128;
+  constexpr std::size_t REPLY_MARKUP_EXTRA_SIZE = 256;
+
+  ServerBotMemoryUsage res;
+  res.message_cache_bytes_ =
+      messages_.calc_size() * (HASH_TABLE_ENTRY_SIZE + sizeof(MessageInfo) + MESSAGE_CONTENT_SIZE);
+  res.user_cache_bytes_ = users_.calc_size() * (HASH_TABLE_ENTRY_SIZE + sizeof(UserInfo) + USER_EXTRA_SIZE);
+  res.chat_cache_bytes_ = chats_.calc_size() * (HASH_TABLE_ENTRY_SIZE + sizeof(ChatInfo) + CHAT_EXTRA_SIZE) +
+                          groups_.calc_size() * (HASH_TABLE_ENTRY_SIZE + sizeof(GroupInfo) + GROUP_EXTRA_SIZE);
+  res.supergroup_cache_bytes_ =
+      supergroups_.calc_size() * (HASH_TABLE_ENTRY_SIZE + sizeof(SupergroupInfo) + SUPERGROUP_EXTRA_SIZE);
+  res.json_cache_bytes_ = json_cache_bytes_;
+  // a parsed keyboard keeps the same strings as its JSON representation in addition to the key itself
+  res.reply_markup_cache_bytes_ =
+      reply_markup_cache_.size() * (sizeof(ReplyMarkupCacheEntry) + REPLY_MARKUP_EXTRA_SIZE) +
+      2 * reply_markup_cache_key_bytes_ + reply_markup_seen_hashes_.size() * sizeof(td::uint64);
+  if (added_update_count_ > 0) {
+    auto pending_update_count = parameters_->shared_data_->tqueue_->get_size(tqueue_id_);
+    res.pending_update_bytes_ = static_cast<std::size_t>(static_cast<double>(pending_update_count) *
+                                                         static_cast<double>(added_update_bytes_) /
+                                                         static_cast<double>(added_update_count_));
+  }
   return res;
 }
 
@@ -7513,6 +7637,7 @@ void Client::start_up() {
 }
 
 void Client::send(PromisedQueryPtr query) {
+  CpuTimeGuard cpu_time_guard(this);
   if (!query->is_internal()) {
     query->set_stat_actor(stat_actor_);
     if (!parameters_->local_mode_ && !is_local_method(query->method()) &&
@@ -7533,6 +7658,7 @@ void Client::send(PromisedQueryPtr query) {
       }
     }
   }
+  query->set_stage(Query::Stage::Queued);
   cmd_queue_.emplace(std::move(query));
   loop();
 }
@@ -7551,6 +7677,47 @@ void Client::loop() {
   }
 }
 
+Client::CpuTimeGuard::CpuTimeGuard(Client *client) : client_(client) {
+  if (client_->cpu_time_guard_depth_++ == 0 && client_->parameters_->shared_data_->need_cpu_time_stats_) {
+    start_cpu_time_ = get_thread_cpu_time();
+  }
+}
+
+Client::CpuTimeGuard::~CpuTimeGuard() {
+  if (--client_->cpu_time_guard_depth_ == 0 && start_cpu_time_ >= 0) {
+    client_->add_cpu_time(td::max(get_thread_cpu_time() - start_cpu_time_, 0.0), 0.0);
+  }
+}
+
+void Client::add_cpu_time(double cpu_time, double serialization_cpu_time) {
+  pending_cpu_time_ += cpu_time;
+  pending_serialization_cpu_time_ += serialization_cpu_time;
+  if (cpu_time_guard_depth_ > 0) {
+    return;
+  }
+
+  // CPU time is reported in batches to avoid sending an event for each handler
+  auto now = td::Time::now();
+  if (pending_cpu_time_ < MAX_PENDING_CPU_TIME && now < last_cpu_time_flush_time_ + CPU_TIME_FLUSH_PERIOD) {
+    // the actor timeout is used to close the client after td_client_ is closed
+    if (!td_client_.empty() && !has_timeout()) {
+      set_timeout_at(last_cpu_time_flush_time_ + CPU_TIME_FLUSH_PERIOD);
+    }
+    return;
+  }
+  flush_cpu_time(now);
+}
+
+void Client::flush_cpu_time(double now) {
+  if (pending_cpu_time_ > 0 || pending_serialization_cpu_time_ > 0) {
+    send_closure(stat_actor_, &BotStatActor::add_event<ServerBotStat::CpuTime>,
+                 ServerBotStat::CpuTime{pending_cpu_time_, pending_serialization_cpu_time_}, now);
+    pending_cpu_time_ = 0;
+    pending_serialization_cpu_time_ = 0;
+  }
+  last_cpu_time_flush_time_ = now;
+}
+
 void Client::on_get_reply_message(int64 chat_id, object_ptr<td_api::message> reply_to_message) {
   auto &queue = new_message_queues_[chat_id];
   CHECK(queue.has_active_request_);
@@ -7785,6 +7952,7 @@ void Client::check_chat_access(int64 chat_id, AccessRights access_rights, const
     default:
       UNREACHABLE();
   }
+  query->set_stage(Query::Stage::ChatChecked);
   on_success(chat_id, std::move(query));
 }
 
@@ -8818,6 +8986,7 @@ void Client::on_update(object_ptr<td_api::Object> result) {
 }
 
 void Client::on_result(td::uint64 id, object_ptr<td_api::Object> result) {
+  CpuTimeGuard cpu_time_guard(this);
   LOG(DEBUG) << "Receive from Td: " << id << " " << to_string(result);
   if (flood_limited_query_count_ > 0 && td::Time::now() > next_flood_limit_warning_time_) {
     LOG(WARNING) << "Flood-limited " << flood_limited_query_count_ << " queries";
@@ -8841,6 +9010,8 @@ void Client::on_closed() {
   CHECK(logging_out_ || closing_);
   CHECK(!td_client_.empty());
   td_client_.reset();
+  cancel_timeout();
+  flush_cpu_time(td::Time::now());
 
   if (webhook_set_query_) {
     fail_query_closing(std::move(webhook_set_query_));
@@ -8928,6 +9099,11 @@ void Client::finish_closing() {
 }
 
 void Client::timeout_expired() {
+  flush_cpu_time(td::Time::now());
+  if (!td_client_.empty()) {
+    // the timeout was set only to report pending CPU time
+    return;
+  }
   LOG(WARNING) << "Stop client";
   stop();
 }
@@ -8968,6 +9144,21 @@ td_api::object_ptr<td_api::InputMessageReplyTo> Client::get_input_message_reply_
   return nullptr;
 }
 
+td::Result<td::JsonValue> Client::decode_json_argument(const Query *query, td::Slice argument_name,
+                                                       td::MutableSlice json) {
+  if (!query->need_cpu_time_stats()) {
+    return json_decode(json);
+  }
+  auto size = json.size();
+  auto start_cpu_time = get_thread_cpu_time();
+  auto result = json_decode(json);
+  if (start_cpu_time >= 0) {
+    SerializationStat::instance().add_parsing(argument_name, td::max(get_thread_cpu_time() - start_cpu_time, 0.0),
+                                              size);
+  }
+  return result;
+}
+
 td::Result<Client::InputReplyParameters> Client::get_reply_parameters(const Query *query) {
   if (!query->has_arg("reply_parameters")) {
     InputReplyParameters result;
@@ -8982,7 +9173,7 @@ td::Result<Client::InputReplyParameters> Client::get_reply_parameters(const Quer
   }
 
   LOG(INFO) << "Parsing JSON object: " << reply_parameters;
-  auto r_value = json_decode(reply_parameters);
+  auto r_value = decode_json_argument(query, "reply_parameters", reply_parameters);
   if (r_value.is_error()) {
     LOG(INFO) << "Can't parse JSON object: " << r_value.error();
     return td::Status::Error(400, "Can't parse reply parameters JSON object");
@@ -9253,14 +9444,63 @@ td::Result<td_api::object_ptr<td_api::ReplyMarkup>> Client::get_reply_markup(con
     return nullptr;
   }
 
+  // the same inline keyboard is often sent with many messages, so parsed inline keyboards are cached
+  // if they are received at least twice
+  td::uint64 cache_hash = 0;
+  td::string cache_key;
+  if (reply_markup.size() <= MAX_CACHED_REPLY_MARKUP_LENGTH) {
+    cache_hash = td::crc64(reply_markup);
+    for (auto it = reply_markup_cache_.begin(); it != reply_markup_cache_.end(); ++it) {
+      if (it->hash_ == cache_hash && td::Slice(it->json_) == reply_markup) {
+        reply_markup_cache_hit_count_++;
+        object_ptr<td_api::ReplyMarkup> result = copy_inline_keyboard(it->keyboard_.get());
+        std::rotate(it, it + 1, reply_markup_cache_.end());
+        return std::move(result);
+      }
+    }
+    reply_markup_cache_miss_count_++;
+
+    if (td::contains(reply_markup_seen_hashes_, cache_hash)) {
+      // the JSON object is modified by the parser, so the key must be copied beforehand
+      cache_key = reply_markup.str();
+    } else if (reply_markup_seen_hashes_.size() < REPLY_MARKUP_SEEN_HASH_COUNT) {
+      reply_markup_seen_hashes_.push_back(cache_hash);
+    } else {
+      reply_markup_seen_hashes_[reply_markup_seen_hash_pos_] = cache_hash;
+      reply_markup_seen_hash_pos_ = (reply_markup_seen_hash_pos_ + 1) % REPLY_MARKUP_SEEN_HASH_COUNT;
+    }
+  }
+
   LOG(INFO) << "Parsing JSON object: " << reply_markup;
-  auto r_value = json_decode(reply_markup);
+  auto r_value = decode_json_argument(query, "reply_markup", reply_markup);
   if (r_value.is_error()) {
     LOG(INFO) << "Can't parse JSON object: " << r_value.error();
     return td::Status::Error(400, "Can't parse reply keyboard markup JSON object");
   }
 
-  return get_reply_markup(r_value.move_as_ok(), bot_user_ids);
+  auto r_reply_markup = get_reply_markup(r_value.move_as_ok(), bot_user_ids);
+  if (!cache_key.empty() && r_reply_markup.is_ok() && r_reply_markup.ok() != nullptr &&
+      r_reply_markup.ok()->get_id() == td_api::replyMarkupInlineKeyboard::ID) {
+    auto inline_keyboard = static_cast<const td_api::replyMarkupInlineKeyboard *>(r_reply_markup.ok().get());
+    // bot user identifiers of login URL buttons can change, so such keyboards aren't cached
+    if (!has_login_url_buttons(inline_keyboard)) {
+      while (!reply_markup_cache_.empty() &&
+             (reply_markup_cache_.size() >= MAX_REPLY_MARKUP_CACHE_SIZE ||
+              reply_markup_cache_key_bytes_ + cache_key.size() > MAX_REPLY_MARKUP_CACHE_KEY_BYTES)) {
+        reply_markup_cache_key_bytes_ -= reply_markup_cache_[0].json_.size();
+        reply_markup_cache_.erase(reply_markup_cache_.begin());
+      }
+      td::remove(reply_markup_seen_hashes_, cache_hash);
+      reply_markup_seen_hash_pos_ = 0;
+      reply_markup_cache_key_bytes_ += cache_key.size();
+      ReplyMarkupCacheEntry entry;
+      entry.hash_ = cache_hash;
+      entry.json_ = std::move(cache_key);
+      entry.keyboard_ = copy_inline_keyboard(inline_keyboard);
+      reply_markup_cache_.push_back(std::move(entry));
+    }
+  }
+  return r_reply_markup;
 }
 
 td::Result<td_api::object_ptr<td_api::ReplyMarkup>> Client::get_reply_markup(td::JsonValue &&value,
@@ -9371,7 +9611,7 @@ td::Result<td_api::object_ptr<td_api::inputSuggestedPostInfo>> Client::get_input
   }
 
   LOG(INFO) << "Parsing JSON object: " << suggested_post;
-  auto r_value = json_decode(suggested_post);
+  auto r_value = decode_json_argument(query, "suggested_post_parameters", suggested_post);
   if (r_value.is_error()) {
     LOG(INFO) << "Can't parse JSON object: " << r_value.error();
     return td::Status::Error(400, "Can't parse suggested post parameters JSON object");
@@ -9489,7 +9729,7 @@ td::Result<td::vector<td_api::object_ptr<td_api::shippingOption>>> Client::get_s
   TRY_RESULT(shipping_options, get_required_string_arg(query, "shipping_options"));
 
   LOG(INFO) << "Parsing JSON object: " << shipping_options;
-  auto r_value = json_decode(shipping_options);
+  auto r_value = decode_json_argument(query, "shipping_options", shipping_options);
   if (r_value.is_error()) {
     LOG(INFO) << "Can't parse JSON object: " << r_value.error();
     return td::Status::Error(400, "Can't parse shipping options JSON object");
@@ -9777,7 +10017,7 @@ td::Result<td_api::object_ptr<td_api::inlineQueryResultsButton>> Client::get_inl
   }
 
   LOG(INFO) << "Parsing JSON object: " << button;
-  auto r_value = json_decode(button);
+  auto r_value = decode_json_argument(query, "button", button);
   if (r_value.is_error()) {
     LOG(INFO) << "Can't parse JSON object: " << r_value.error();
     return td::Status::Error(400, "Can't parse inline query results button JSON object");
@@ -9799,7 +10039,7 @@ td::Result<td::vector<td_api::object_ptr<td_api::InputInlineQueryResult>>> Clien
   }
 
   LOG(INFO) << "Parsing JSON object: " << results_encoded;
-  auto r_values = json_decode(results_encoded);
+  auto r_values = decode_json_argument(query, "results", results_encoded);
   if (r_values.is_error()) {
     return td::Status::Error(
         400, PSLICE() << "Can't parse JSON encoded inline query results: " << r_values.error().message());
@@ -9842,7 +10082,7 @@ td::Result<td_api::object_ptr<td_api::InputInlineQueryResult>> Client::get_inlin
   }
 
   LOG(INFO) << "Parsing JSON object: " << result_encoded;
-  auto r_value = json_decode(result_encoded);
+  auto r_value = decode_json_argument(query, "result", result_encoded);
   if (r_value.is_error()) {
     return td::Status::Error(
         400, PSLICE() << "Can't parse JSON encoded web view query results " << r_value.error().message());
@@ -10198,7 +10438,7 @@ td::Result<Client::BotCommandScope> Client::get_bot_command_scope(const Query *q
   }
 
   LOG(INFO) << "Parsing JSON object: " << scope;
-  auto r_value = json_decode(scope);
+  auto r_value = decode_json_argument(query, "scope", scope);
   if (r_value.is_error()) {
     LOG(INFO) << "Can't parse JSON object: " << r_value.error();
     return td::Status::Error(400, "Can't parse BotCommandScope JSON object");
@@ -10230,7 +10470,7 @@ td::Result<td::vector<td_api::object_ptr<td_api::botCommand>>> Client::get_bot_c
     return td::vector<object_ptr<td_api::botCommand>>();
   }
   LOG(INFO) << "Parsing JSON object: " << commands;
-  auto r_value = json_decode(commands);
+  auto r_value = decode_json_argument(query, "commands", commands);
   if (r_value.is_error()) {
     LOG(INFO) << "Can't parse JSON object: " << r_value.error();
     return td::Status::Error(400, "Can't parse commands JSON object");
@@ -10284,7 +10524,7 @@ td::Result<td_api::object_ptr<td_api::botMenuButton>> Client::get_bot_menu_butto
   }
 
   LOG(INFO) << "Parsing JSON object: " << menu_button;
-  auto r_value = json_decode(menu_button);
+  auto r_value = decode_json_argument(query, "menu_button", menu_button);
   if (r_value.is_error()) {
     LOG(INFO) << "Can't parse JSON object: " << r_value.error();
     return td::Status::Error(400, "Can't parse menu button JSON object");
@@ -10334,7 +10574,7 @@ td::Result<td_api::object_ptr<td_api::chatAdministratorRights>> Client::get_chat
   }
 
   LOG(INFO) << "Parsing JSON object: " << rights;
-  auto r_value = json_decode(rights);
+  auto r_value = decode_json_argument(query, "rights", rights);
   if (r_value.is_error()) {
     LOG(INFO) << "Can't parse JSON object: " << r_value.error();
     return td::Status::Error(400, "Can't parse ChatAdministratorRights JSON object");
@@ -10417,7 +10657,7 @@ td::Result<td_api::object_ptr<td_api::maskPosition>> Client::get_mask_position(c
   }
 
   LOG(INFO) << "Parsing JSON object: " << mask_position;
-  auto r_value = json_decode(mask_position);
+  auto r_value = decode_json_argument(query, field_name, mask_position);
   if (r_value.is_error()) {
     LOG(INFO) << "Can't parse JSON object: " << r_value.error();
     return td::Status::Error(400, "Can't parse mask position JSON object");
@@ -10455,9 +10695,9 @@ td::Result<td::string> Client::get_sticker_emojis(td::JsonValue &&value) {
   return std::move(result);
 }
 
-td::Result<td::string> Client::get_sticker_emojis(td::MutableSlice emoji_list) {
+td::Result<td::string> Client::get_sticker_emojis(const Query *query, td::MutableSlice emoji_list) {
   LOG(INFO) << "Parsing JSON object: " << emoji_list;
-  auto r_value = json_decode(emoji_list);
+  auto r_value = decode_json_argument(query, "emoji_list", emoji_list);
   if (r_value.is_error()) {
     LOG(INFO) << "Can't parse JSON object: " << r_value.error();
     return td::Status::Error(400, "Can't parse emoji list JSON array");
@@ -10531,7 +10771,7 @@ td::Result<td_api::object_ptr<td_api::inputSticker>> Client::get_input_sticker(c
   if (query->has_arg("sticker") || query->file("sticker") != nullptr) {
     auto sticker = query->arg("sticker");
     LOG(INFO) << "Parsing JSON object: " << sticker;
-    auto r_value = json_decode(sticker);
+    auto r_value = decode_json_argument(query, "sticker", sticker);
     if (r_value.is_error()) {
       LOG(INFO) << "Can't parse JSON object: " << r_value.error();
       return td::Status::Error(400, "Can't parse sticker JSON object");
@@ -10584,7 +10824,7 @@ td::Result<td::vector<td_api::object_ptr<td_api::inputSticker>>> Client::get_inp
     auto sticker_format_str = query->arg("sticker_format");
     auto stickers = query->arg("stickers");
     LOG(INFO) << "Parsing JSON object: " << stickers;
-    auto r_value = json_decode(stickers);
+    auto r_value = decode_json_argument(query, "stickers", stickers);
     if (r_value.is_error()) {
       LOG(INFO) << "Can't parse JSON object: " << r_value.error();
       return td::Status::Error(400, "Can't parse stickers JSON object");
@@ -10717,7 +10957,7 @@ td::Result<td::vector<td_api::object_ptr<td_api::inputPassportElementError>>> Cl
     const Query *query) {
   auto input_errors = query->arg("errors");
   LOG(INFO) << "Parsing JSON object: " << input_errors;
-  auto r_value = json_decode(input_errors);
+  auto r_value = decode_json_argument(query, "errors", input_errors);
   if (r_value.is_error()) {
     LOG(INFO) << "Can't parse JSON object: " << r_value.error();
     return td::Status::Error(400, "Can't parse errors JSON object");
@@ -10742,7 +10982,7 @@ td::Result<td::vector<td_api::object_ptr<td_api::inputPassportElementError>>> Cl
 td::JsonValue Client::get_input_entities(const Query *query, td::Slice field_name) {
   auto entities = query->arg(field_name);
   if (!entities.empty()) {
-    auto r_value = json_decode(entities);
+    auto r_value = decode_json_argument(query, field_name, entities);
     if (r_value.is_ok()) {
       return r_value.move_as_ok();
     }
@@ -10896,7 +11136,7 @@ td::Result<td_api::object_ptr<td_api::linkPreviewOptions>> Client::get_link_prev
   }
 
   LOG(INFO) << "Parsing JSON object: " << link_preview_options;
-  auto r_value = json_decode(link_preview_options);
+  auto r_value = decode_json_argument(query, "link_preview_options", link_preview_options);
   if (r_value.is_error()) {
     LOG(INFO) << "Can't parse JSON object: " << r_value.error();
     return td::Status::Error(400, "Can't parse link preview options JSON object");
@@ -10972,7 +11212,7 @@ td::Result<td_api::object_ptr<td_api::chatPermissions>> Client::get_chat_permiss
   if (query->has_arg("permissions")) {
     allow_legacy = false;
 
-    auto r_value = json_decode(query->arg("permissions"));
+    auto r_value = decode_json_argument(query, "permissions", query->arg("permissions"));
     if (r_value.is_error()) {
       LOG(INFO) << "Can't parse JSON object: " << r_value.error();
       return td::Status::Error(400, "Can't parse permissions JSON object");
@@ -11135,7 +11375,7 @@ td::Result<td_api::object_ptr<td_api::inputChecklist>> Client::get_input_checkli
   TRY_RESULT(checklist, get_required_string_arg(query, field_name));
 
   LOG(INFO) << "Parsing JSON object: " << checklist;
-  auto r_value = json_decode(checklist);
+  auto r_value = decode_json_argument(query, field_name, checklist);
   if (r_value.is_error()) {
     LOG(INFO) << "Can't parse JSON object: " << r_value.error();
     return td::Status::Error(400, "Can't parse InputChecklist JSON object");
@@ -11245,7 +11485,7 @@ td::Result<td_api::object_ptr<td_api::InputMessageContent>> Client::get_input_me
   TRY_RESULT(media, get_required_string_arg(query, field_name));
 
   LOG(INFO) << "Parsing JSON object: " << media;
-  auto r_value = json_decode(media);
+  auto r_value = decode_json_argument(query, field_name, media);
   if (r_value.is_error()) {
     LOG(INFO) << "Can't parse JSON object: " << r_value.error();
     return td::Status::Error(400, "Can't parse input media JSON object");
@@ -11263,7 +11503,7 @@ td::Result<td::vector<td_api::object_ptr<td_api::InputMessageContent>>> Client::
   TRY_RESULT(media, get_required_string_arg(query, field_name));
 
   LOG(INFO) << "Parsing JSON object: " << media;
-  auto r_value = json_decode(media);
+  auto r_value = decode_json_argument(query, field_name, media);
   if (r_value.is_error()) {
     LOG(INFO) << "Can't parse JSON object: " << r_value.error();
     return td::Status::Error(400, "Can't parse media JSON object");
@@ -11342,7 +11582,7 @@ td::Result<td_api::object_ptr<td_api::inputPaidMedia>> Client::get_input_paid_me
   TRY_RESULT(media, get_required_string_arg(query, field_name));
 
   LOG(INFO) << "Parsing JSON object: " << media;
-  auto r_value = json_decode(media);
+  auto r_value = decode_json_argument(query, field_name, media);
   if (r_value.is_error()) {
     LOG(INFO) << "Can't parse JSON object: " << r_value.error();
     return td::Status::Error(400, "Can't parse input paid media JSON object");
@@ -11360,7 +11600,7 @@ td::Result<td::vector<td_api::object_ptr<td_api::inputPaidMedia>>> Client::get_p
   TRY_RESULT(media, get_required_string_arg(query, field_name));
 
   LOG(INFO) << "Parsing JSON object: " << media;
-  auto r_value = json_decode(media);
+  auto r_value = decode_json_argument(query, field_name, media);
   if (r_value.is_error()) {
     LOG(INFO) << "Can't parse JSON object: " << r_value.error();
     return td::Status::Error(400, "Can't parse paid media JSON object");
@@ -11400,7 +11640,7 @@ td::Result<td_api::object_ptr<td_api::inputMessageInvoice>> Client::get_input_me
   TRY_RESULT(currency, get_required_string_arg(query, "currency"));
 
   TRY_RESULT(labeled_price_parts, get_required_string_arg(query, "prices"));
-  auto r_labeled_price_parts_value = json_decode(labeled_price_parts);
+  auto r_labeled_price_parts_value = decode_json_argument(query, "prices", labeled_price_parts);
   if (r_labeled_price_parts_value.is_error()) {
     return td::Status::Error(400, "Can't parse prices JSON object");
   }
@@ -11421,7 +11661,8 @@ td::Result<td_api::object_ptr<td_api::inputMessageInvoice>> Client::get_input_me
 
     auto suggested_tip_amounts_str = query->arg("suggested_tip_amounts");
     if (!suggested_tip_amounts_str.empty()) {
-      auto r_suggested_tip_amounts_value = json_decode(suggested_tip_amounts_str);
+      auto r_suggested_tip_amounts_value =
+          decode_json_argument(query, "suggested_tip_amounts", suggested_tip_amounts_str);
       if (r_suggested_tip_amounts_value.is_error()) {
         return td::Status::Error(400, "Can't parse suggested_tip_amounts JSON object");
       }
@@ -11467,7 +11708,7 @@ td::Result<td_api::object_ptr<td_api::inputMessageInvoice>> Client::get_input_me
 td::Result<td::vector<td_api::object_ptr<td_api::formattedText>>> Client::get_poll_options(const Query *query) {
   auto input_options = query->arg("options");
   LOG(INFO) << "Parsing JSON object: " << input_options;
-  auto r_value = json_decode(input_options);
+  auto r_value = decode_json_argument(query, "options", input_options);
   if (r_value.is_error()) {
     LOG(INFO) << "Can't parse JSON object: " << r_value.error();
     return td::Status::Error(400, "Can't parse options JSON object");
@@ -11523,7 +11764,7 @@ td::Result<td::vector<td_api::object_ptr<td_api::ReactionType>>> Client::get_rea
     return td::vector<object_ptr<td_api::ReactionType>>();
   }
   LOG(INFO) << "Parsing JSON object: " << types;
-  auto r_value = json_decode(types);
+  auto r_value = decode_json_argument(query, "reaction", types);
   if (r_value.is_error()) {
     LOG(INFO) << "Can't parse JSON object: " << r_value.error();
     return td::Status::Error(400, "Can't parse reaction types JSON object");
@@ -11627,7 +11868,7 @@ td::Result<td_api::object_ptr<td_api::inputStoryAreas>> Client::get_input_story_
     return nullptr;
   }
   LOG(INFO) << "Parsing JSON object: " << areas;
-  auto r_value = json_decode(areas);
+  auto r_value = decode_json_argument(query, "areas", areas);
   if (r_value.is_error()) {
     LOG(INFO) << "Can't parse JSON object: " << r_value.error();
     return td::Status::Error(400, "Can't parse story areas JSON object");
@@ -11684,7 +11925,7 @@ td::Result<td_api::object_ptr<td_api::InputChatPhoto>> Client::get_input_chat_ph
   }
 
   LOG(INFO) << "Parsing JSON object: " << photo;
-  auto r_value = json_decode(photo);
+  auto r_value = decode_json_argument(query, "photo", photo);
   if (r_value.is_error()) {
     LOG(INFO) << "Can't parse JSON object: " << r_value.error();
     return td::Status::Error(400, "Can't parse photo JSON object");
@@ -11731,7 +11972,7 @@ td::Result<td_api::object_ptr<td_api::InputStoryContent>> Client::get_input_stor
   }
 
   LOG(INFO) << "Parsing JSON object: " << content;
-  auto r_value = json_decode(content);
+  auto r_value = decode_json_argument(query, "content", content);
   if (r_value.is_error()) {
     LOG(INFO) << "Can't parse JSON object: " << r_value.error();
     return td::Status::Error(400, "Can't parse story content JSON object");
@@ -11765,7 +12006,7 @@ td::Result<td_api::object_ptr<td_api::acceptedGiftTypes>> Client::get_accepted_g
   }
 
   LOG(INFO) << "Parsing JSON object: " << types;
-  auto r_value = json_decode(types);
+  auto r_value = decode_json_argument(query, "accepted_gift_types", types);
   if (r_value.is_error()) {
     LOG(INFO) << "Can't parse JSON object: " << r_value.error();
     return td::Status::Error(400, "Can't parse accepted gift types JSON object");
@@ -11823,7 +12064,7 @@ td::Result<td::vector<td::int64>> Client::get_message_ids(const Query *query, si
     return td::Status::Error(400, "Message identifiers are not specified");
   }
 
-  auto r_value = json_decode(message_ids_str);
+  auto r_value = decode_json_argument(query, field_name, message_ids_str);
   if (r_value.is_error()) {
     return td::Status::Error(400, PSLICE() << "Can't parse " << field_name << " JSON object");
   }
@@ -11989,6 +12230,7 @@ void Client::on_story_send_failed(int64 chat_id, int64 story_id, object_ptr<td_a
 
 void Client::on_cmd(PromisedQueryPtr query, bool force) {
   LOG(DEBUG) << "Process query " << *query;
+  query->set_stage(Query::Stage::Started);
   if (!td_client_.empty() && was_authorized_) {
     if (query->method() == "close") {
       auto retry_after = static_cast<int>(10 * 60 - (td::Time::now() - start_time_));
@@ -14572,7 +14814,7 @@ td::Status Client::process_get_custom_emoji_stickers_query(PromisedQueryPtr &que
   TRY_RESULT(custom_emoji_ids_json, get_required_string_arg(query.get(), "custom_emoji_ids"));
 
   LOG(INFO) << "Parsing JSON object: " << custom_emoji_ids_json;
-  auto r_value = json_decode(custom_emoji_ids_json);
+  auto r_value = decode_json_argument(query, "custom_emoji_ids", custom_emoji_ids_json);
   if (r_value.is_error()) {
     return td::Status::Error(400, "Can't parse custom emoji identifiers JSON object");
   }
@@ -14736,7 +14978,7 @@ td::Status Client::process_delete_sticker_from_set_query(PromisedQueryPtr &query
 
 td::Status Client::process_set_sticker_emoji_list_query(PromisedQueryPtr &query) {
   TRY_RESULT(input_file, get_sticker_input_file(query.get()));
-  TRY_RESULT(emojis, get_sticker_emojis(query->arg("emoji_list")));
+  TRY_RESULT(emojis, get_sticker_emojis(query, query->arg("emoji_list")));
 
   send_request(make_object<td_api::setStickerEmojis>(std::move(input_file), emojis),
                td::make_unique<TdOnOkQueryCallback>(std::move(query)));
@@ -14747,7 +14989,7 @@ td::Status Client::process_set_sticker_keywords_query(PromisedQueryPtr &query) {
   TRY_RESULT(input_file, get_sticker_input_file(query.get()));
   td::vector<td::string> input_keywords;
   if (query->has_arg("keywords")) {
-    auto r_value = json_decode(query->arg("keywords"));
+    auto r_value = decode_json_argument(query, "keywords", query->arg("keywords"));
     if (r_value.is_error()) {
       LOG(INFO) << "Can't parse JSON object: " << r_value.error();
       return td::Status::Error(400, "Can't parse keywords JSON object");
@@ -15189,7 +15431,8 @@ void Client::finish_set_webhook(PromisedQueryPtr query) {
   webhook_id_ = td::create_actor<WebhookActor>(
       webhook_actor_name, actor_shared(this, webhook_generation_), tqueue_id_, url.move_as_ok(),
       has_webhook_certificate_ ? get_webhook_certificate_path() : td::string(), webhook_max_connections_,
-      query->is_internal(), webhook_ip_address_, webhook_fix_ip_address_, webhook_secret_token_, parameters_);
+      query->is_internal(), webhook_ip_address_, webhook_fix_ip_address_, webhook_secret_token_, parameters_,
+      stat_actor_);
   // wait for webhook verified or webhook callback
   webhook_query_type_ = WebhookQueryType::Verify;
   CHECK(!active_webhook_set_query_);
@@ -15281,6 +15524,7 @@ td::int64 Client::get_send_message_query_id(PromisedQueryPtr query, bool is_mult
   auto query_id = current_send_message_query_id_++;
   auto &pending_query = pending_send_message_queries_[query_id];
   CHECK(pending_query == nullptr);
+  query->set_stage(Query::Stage::SendAccepted);
   pending_query = td::make_unique<PendingSendMessageQuery>();
   pending_query->query = std::move(query);
   pending_query->is_multisend = is_multisend;
@@ -15570,7 +15814,10 @@ Client::UserInfo *Client::add_user_info(int64 user_id) {
   auto &user_info = users_[user_id];
   if (user_info == nullptr) {
     user_info = td::make_unique<UserInfo>();
+  } else {
+    clear_json_cache(user_info->json_cache);
   }
+  invalidate_chat_json_cache(user_id);
   return user_info.get();
 }
 
@@ -15590,6 +15837,7 @@ void Client::add_group(GroupInfo *group_info, object_ptr<td_api::basicGroup> &&g
 }
 
 Client::GroupInfo *Client::add_group_info(int64 group_id) {
+  invalidate_chat_json_cache(get_basic_group_chat_id(group_id));
   auto &group_info = groups_[group_id];
   if (group_info == nullptr) {
     group_info = td::make_unique<GroupInfo>();
@@ -15621,6 +15869,7 @@ void Client::add_supergroup(SupergroupInfo *supergroup_info, object_ptr<td_api::
 }
 
 Client::SupergroupInfo *Client::add_supergroup_info(int64 supergroup_id) {
+  invalidate_chat_json_cache(get_supergroup_chat_id(supergroup_id));
   auto &supergroup_info = supergroups_[supergroup_id];
   if (supergroup_info == nullptr) {
     supergroup_info = td::make_unique<SupergroupInfo>();
@@ -15636,6 +15885,8 @@ Client::ChatInfo *Client::add_chat(int64 chat_id) {
   auto &chat_info = chats_[chat_id];
   if (chat_info == nullptr) {
     chat_info = td::make_unique<ChatInfo>();
+  } else {
+    clear_json_cache(chat_info->json_cache);
   }
   return chat_info.get();
 }
@@ -15644,6 +15895,18 @@ const Client::ChatInfo *Client::get_chat(int64 chat_id) const {
   return chats_.get_pointer(chat_id);
 }
 
+void Client::clear_json_cache(td::string &json_cache) const {
+  json_cache_bytes_ -= json_cache.size();
+  json_cache = td::string();
+}
+
+void Client::invalidate_chat_json_cache(int64 chat_id) const {
+  auto chat_info = get_chat(chat_id);
+  if (chat_info != nullptr) {
+    clear_json_cache(chat_info->json_cache);
+  }
+}
+
 void Client::set_chat_available_reactions(ChatInfo *chat_info,
                                           object_ptr<td_api::ChatAvailableReactions> &&available_reactions) {
   CHECK(chat_info != nullptr);
@@ -15926,7 +16189,7 @@ td::uint32 Client::get_allowed_update_types(td::MutableSlice allowed_updates, bo
   }
 
   LOG(INFO) << "Parsing JSON object: " << allowed_updates;
-  auto r_value = json_decode(allowed_updates);
+  auto r_value = decode_json_argument(query, "allowed_updates", allowed_updates);
   if (r_value.is_error()) {
     LOG(INFO) << "Can't parse JSON object: " << r_value.error();
     return 0;
@@ -16012,10 +16275,17 @@ void Client::add_update_impl(UpdateType update_type, const td::VirtuallyJsonable
 
   const size_t BUF_SIZE = 1 << 16;
   auto buf = td::StackAllocator::alloc(BUF_SIZE);
+  auto start_cpu_time = parameters_->shared_data_->need_cpu_time_stats_ ? get_thread_cpu_time() : -1.0;
   td::JsonBuilder jb(td::StringBuilder(buf.as_slice(), true));
   jb.enter_value() << get_update_type_name(update_type);
   jb.string_builder() << ":";
   jb.enter_value() << update;
+  if (start_cpu_time >= 0) {
+    auto serialization_cpu_time = td::max(get_thread_cpu_time() - start_cpu_time, 0.0);
+    add_cpu_time(0.0, serialization_cpu_time);
+    SerializationStat::instance().add_update(get_update_type_name(update_type), serialization_cpu_time,
+                                             jb.string_builder().as_cslice().size());
+  }
   if (jb.string_builder().is_error()) {
     LOG(ERROR) << "JSON buffer overflow";
     return;
@@ -16027,6 +16297,8 @@ void Client::add_update_impl(UpdateType update_type, const td::VirtuallyJsonable
   if (r_id.is_ok()) {
     auto id = r_id.move_as_ok();
     LOG(DEBUG) << "Update " << id << " was added for " << timeout << " seconds: " << update_slice;
+    added_update_count_++;
+    added_update_bytes_ += static_cast<int64>(update_slice.size());
     if (webhook_url_.empty()) {
       long_poll_wakeup(false);
     } else {
@@ -16788,6 +17060,93 @@ bool Client::are_equal_inline_keyboards(const td_api::replyMarkupInlineKeyboard
   return true;
 }
 
+td_api::object_ptr<td_api::inlineKeyboardButton> Client::copy_inline_keyboard_button(
+    const td_api::inlineKeyboardButton *button) {
+  CHECK(button != nullptr);
+  auto make_button = [&](object_ptr<td_api::InlineKeyboardButtonType> type) {
+    return make_object<td_api::inlineKeyboardButton>(button->text_, std::move(type));
+  };
+  switch (button->type_->get_id()) {
+    case td_api::inlineKeyboardButtonTypeUrl::ID: {
+      auto type = static_cast<const td_api::inlineKeyboardButtonTypeUrl *>(button->type_.get());
+      return make_button(make_object<td_api::inlineKeyboardButtonTypeUrl>(type->url_));
+    }
+    case td_api::inlineKeyboardButtonTypeLoginUrl::ID: {
+      auto type = static_cast<const td_api::inlineKeyboardButtonTypeLoginUrl *>(button->type_.get());
+      return make_button(
+          make_object<td_api::inlineKeyboardButtonTypeLoginUrl>(type->url_, type->id_, type->forward_text_));
+    }
+    case td_api::inlineKeyboardButtonTypeCallback::ID: {
+      auto type = static_cast<const td_api::inlineKeyboardButtonTypeCallback *>(button->type_.get());
+      return make_button(make_object<td_api::inlineKeyboardButtonTypeCallback>(type->data_));
+    }
+    case td_api::inlineKeyboardButtonTypeCallbackGame::ID:
+      return make_button(make_object<td_api::inlineKeyboardButtonTypeCallbackGame>());
+    case td_api::inlineKeyboardButtonTypeSwitchInline::ID: {
+      auto type = static_cast<const td_api::inlineKeyboardButtonTypeSwitchInline *>(button->type_.get());
+      object_ptr<td_api::TargetChat> target_chat;
+      switch (type->target_chat_->get_id()) {
+        case td_api::targetChatCurrent::ID:
+          target_chat = make_object<td_api::targetChatCurrent>();
+          break;
+        case td_api::targetChatChosen::ID: {
+          auto types = static_cast<const td_api::targetChatChosen *>(type->target_chat_.get())->types_.get();
+          target_chat = make_object<td_api::targetChatChosen>(
+              make_object<td_api::targetChatTypes>(types->allow_user_chats_, types->allow_bot_chats_,
+                                                   types->allow_group_chats_, types->allow_channel_chats_));
+          break;
+        }
+        default:
+          UNREACHABLE();
+      }
+      return make_button(
+          make_object<td_api::inlineKeyboardButtonTypeSwitchInline>(type->query_, std::move(target_chat)));
+    }
+    case td_api::inlineKeyboardButtonTypeBuy::ID:
+      return make_button(make_object<td_api::inlineKeyboardButtonTypeBuy>());
+    case td_api::inlineKeyboardButtonTypeWebApp::ID: {
+      auto type = static_cast<const td_api::inlineKeyboardButtonTypeWebApp *>(button->type_.get());
+      return make_button(make_object<td_api::inlineKeyboardButtonTypeWebApp>(type->url_));
+    }
+    case td_api::inlineKeyboardButtonTypeCopyText::ID: {
+      auto type = static_cast<const td_api::inlineKeyboardButtonTypeCopyText *>(button->type_.get());
+      return make_button(make_object<td_api::inlineKeyboardButtonTypeCopyText>(type->text_));
+    }
+    default:
+      // the button can't be received from a bot
+      UNREACHABLE();
+      return nullptr;
+  }
+}
+
+bool Client::has_login_url_buttons(const td_api::replyMarkupInlineKeyboard *inline_keyboard) {
+  CHECK(inline_keyboard != nullptr);
+  for (auto &row : inline_keyboard->rows_) {
+    for (auto &button : row) {
+      if (button->type_->get_id() == td_api::inlineKeyboardButtonTypeLoginUrl::ID) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+td_api::object_ptr<td_api::replyMarkupInlineKeyboard> Client::copy_inline_keyboard(
+    const td_api::replyMarkupInlineKeyboard *inline_keyboard) {
+  CHECK(inline_keyboard != nullptr);
+  td::vector<td::vector<object_ptr<td_api::inlineKeyboardButton>>> rows;
+  rows.reserve(inline_keyboard->rows_.size());
+  for (auto &row : inline_keyboard->rows_) {
+    td::vector<object_ptr<td_api::inlineKeyboardButton>> new_row;
+    new_row.reserve(row.size());
+    for (auto &button : row) {
+      new_row.push_back(copy_inline_keyboard_button(button.get()));
+    }
+    rows.push_back(std::move(new_row));
+  }
+  return make_object<td_api::replyMarkupInlineKeyboard>(std::move(rows));
+}
+
 void Client::set_message_reply_markup(MessageInfo *message_info, object_ptr<td_api::ReplyMarkup> &&reply_markup) {
   if (reply_markup != nullptr && reply_markup->get_id() != td_api::replyMarkupInlineKeyboard::ID) {
     reply_markup = nullptr;
@@ -56,6 +56,8 @@ class Client final : public WebhookActor::Callback {
   // for stats
   ServerBotInfo get_bot_info() const;
 
+  ServerBotMemoryUsage get_memory_usage() const;
+
  private:
   using int32 = td::int32;
   using int64 = td::int64;
@@ -85,6 +87,11 @@ class Client final : public WebhookActor::Callback {
 
   static constexpr std::size_t MAX_STICKER_EMOJI_COUNT = 20;
 
+  static constexpr std::size_t MAX_CACHED_REPLY_MARKUP_LENGTH = 1024;
+  static constexpr std::size_t MAX_REPLY_MARKUP_CACHE_SIZE = 16;
+  static constexpr std::size_t MAX_REPLY_MARKUP_CACHE_KEY_BYTES = 8192;
+  static constexpr std::size_t REPLY_MARKUP_SEEN_HASH_COUNT = 64;
+
   class JsonEmptyObject;
   class JsonFile;
   class JsonDatedFile;
@@ -240,6 +247,7 @@ class Client final : public WebhookActor::Callback {
   class JsonStarTransactions;
   class JsonUpdateTypes;
   class JsonWebhookInfo;
+  class JsonWebhookDeliveryStatistics;
   class JsonStickerSet;
   class JsonSentWebAppMessage;
   class JsonPreparedInlineMessageId;
@@ -479,6 +487,9 @@ class Client final : public WebhookActor::Callback {
 
   static object_ptr<td_api::InputMessageReplyTo> get_input_message_reply_to(InputReplyParameters &&reply_parameters);
 
+  static td::Result<td::JsonValue> decode_json_argument(const Query *query, td::Slice argument_name,
+                                                       td::MutableSlice json);
+
   static td::Result<InputReplyParameters> get_reply_parameters(const Query *query);
 
   static td::Result<InputReplyParameters> get_reply_parameters(td::JsonValue &&value);
@@ -488,7 +499,7 @@ class Client final : public WebhookActor::Callback {
   static td::Result<object_ptr<td_api::inlineKeyboardButton>> get_inline_keyboard_button(td::JsonValue &button,
                                                                                          BotUserIds &bot_user_ids);
 
-  static td::Result<object_ptr<td_api::ReplyMarkup>> get_reply_markup(const Query *query, BotUserIds &bot_user_ids);
+  td::Result<object_ptr<td_api::ReplyMarkup>> get_reply_markup(const Query *query, BotUserIds &bot_user_ids);
 
   static td::Result<object_ptr<td_api::ReplyMarkup>> get_reply_markup(td::JsonValue &&value, BotUserIds &bot_user_ids);
 
@@ -579,7 +590,7 @@ class Client final : public WebhookActor::Callback {
 
   static td::Result<td::string> get_sticker_emojis(td::JsonValue &&value);
 
-  static td::Result<td::string> get_sticker_emojis(td::MutableSlice emoji_list);
+  static td::Result<td::string> get_sticker_emojis(const Query *query, td::MutableSlice emoji_list);
 
   static td::Result<object_ptr<td_api::StickerFormat>> get_sticker_format(td::Slice sticker_format);
 
@@ -969,6 +980,25 @@ class Client final : public WebhookActor::Callback {
 
   void loop() final;
 
+  // attributes CPU time spent on the Client thread until destruction to the bot; nested guards are no-op
+  class CpuTimeGuard {
+   public:
+    explicit CpuTimeGuard(Client *client);
+    CpuTimeGuard(const CpuTimeGuard &) = delete;
+    CpuTimeGuard &operator=(const CpuTimeGuard &) = delete;
+    CpuTimeGuard(CpuTimeGuard &&) = delete;
+    CpuTimeGuard &operator=(CpuTimeGuard &&) = delete;
+    ~CpuTimeGuard();
+
+   private:
+    Client *client_;
+    double start_cpu_time_ = -1.0;
+  };
+
+  void add_cpu_time(double cpu_time, double serialization_cpu_time);
+
+  void flush_cpu_time(double now);
+
   void timeout_expired() final;
 
   struct UserInfo {
@@ -1001,6 +1031,8 @@ class Client final : public WebhookActor::Callback {
     bool is_premium = false;
     bool added_to_attachment_menu = false;
     bool has_topics = false;
+
+    mutable td::string json_cache;  // JSON representation of the user without full bot information
   };
   static void add_user(UserInfo *user_info, object_ptr<td_api::user> &&user);
   UserInfo *add_user_info(int64 user_id);
@@ -1075,9 +1107,16 @@ class Client final : public WebhookActor::Callback {
       int64 group_id;
       int64 supergroup_id;
     };
+
+    mutable td::string json_cache;  // short JSON representation of the chat
   };
   ChatInfo *add_chat(int64 chat_id);
   const ChatInfo *get_chat(int64 chat_id) const;
+  void clear_json_cache(td::string &json_cache) const;
+
+  void invalidate_chat_json_cache(int64 chat_id) const;
+
+  mutable std::size_t json_cache_bytes_ = 0;  // total size of cached JSON representations of users and chats
 
   void set_chat_available_reactions(ChatInfo *chat_info,
                                     object_ptr<td_api::ChatAvailableReactions> &&available_reactions);
@@ -1163,6 +1202,14 @@ class Client final : public WebhookActor::Callback {
   static bool are_equal_inline_keyboards(const td_api::replyMarkupInlineKeyboard *lhs,
                                          const td_api::replyMarkupInlineKeyboard *rhs);
 
+  static object_ptr<td_api::inlineKeyboardButton> copy_inline_keyboard_button(
+      const td_api::inlineKeyboardButton *button);
+
+  static bool has_login_url_buttons(const td_api::replyMarkupInlineKeyboard *inline_keyboard);
+
+  static object_ptr<td_api::replyMarkupInlineKeyboard> copy_inline_keyboard(
+      const td_api::replyMarkupInlineKeyboard *inline_keyboard);
+
   static void set_message_reply_markup(MessageInfo *message_info, object_ptr<td_api::ReplyMarkup> &&reply_markup);
 
   static int64 get_sticker_set_id(const object_ptr<td_api::MessageContent> &content);
@@ -1481,6 +1528,18 @@ class Client final : public WebhookActor::Callback {
   };
   BotUserIds bot_user_ids_;
 
+  struct ReplyMarkupCacheEntry {
+    td::uint64 hash_ = 0;
+    td::string json_;
+    object_ptr<td_api::replyMarkupInlineKeyboard> keyboard_;
+  };
+  td::vector<ReplyMarkupCacheEntry> reply_markup_cache_;  // the most recently used entries are at the end
+  std::size_t reply_markup_cache_key_bytes_ = 0;
+  td::vector<td::uint64> reply_markup_seen_hashes_;  // hashes of not cached keyboards; a keyboard is cached if seen twice
+  std::size_t reply_markup_seen_hash_pos_ = 0;
+  int64 reply_markup_cache_hit_count_ = 0;
+  int64 reply_markup_cache_miss_count_ = 0;
+
   struct PendingBotResolveQuery {
     std::size_t pending_resolve_count = 0;
     PromisedQueryPtr query;
@@ -1562,6 +1621,16 @@ class Client final : public WebhookActor::Callback {
   std::shared_ptr<const ClientParameters> parameters_;
 
   td::ActorId<BotStatActor> stat_actor_;
+
+  static constexpr double CPU_TIME_FLUSH_PERIOD = 1.0;
+  static constexpr double MAX_PENDING_CPU_TIME = 0.01;
+  int32 cpu_time_guard_depth_ = 0;
+  double pending_cpu_time_ = 0;
+  double pending_serialization_cpu_time_ = 0;
+  double last_cpu_time_flush_time_ = 0;
+
+  int64 added_update_count_ = 0;
+  int64 added_update_bytes_ = 0;
 };
 
 }  // namespace telegram_bot_api
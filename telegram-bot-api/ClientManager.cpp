@@ -23,6 +23,7 @@
 #include "td/actor/MultiPromise.h"
 
 #include "td/utils/common.h"
+#include "td/utils/crypto.h"
 #include "td/utils/format.h"
 #include "td/utils/logging.h"
 #include "td/utils/misc.h"
@@ -69,6 +70,7 @@ void ClientManager::send(PromisedQueryPtr query) {
     // automatically send 429
     return;
   }
+  query->set_stage(Query::Stage::Dispatched);
 
   td::string token = query->token().str();
   if (token[0] == '0' || token.size() > 80u || token.find('/') != td::string::npos ||
@@ -96,7 +98,7 @@ void ClientManager::send(PromisedQueryPtr query) {
     }
 
     td::string ip_address = query->get_peer_ip_address();
-    if (!ip_address.empty()) {
+    if (!ip_address.empty() && !td::begins_with(ip_address, "unix:")) {
       td::IPAddress tmp;
       tmp.init_host_port(ip_address, 0).ignore();
       tmp.clear_ipv6_interface();
@@ -107,19 +109,26 @@ void ClientManager::send(PromisedQueryPtr query) {
     LOG(DEBUG) << "Receive incoming query for new bot " << token << " from " << ip_address;
     if (!ip_address.empty()) {
       LOG(DEBUG) << "Check Client creation flood control for IP address " << ip_address;
-      auto res = flood_controls_.emplace(std::move(ip_address), td::FloodControlFast());
-      auto &flood_control = res.first->second;
-      if (res.second) {
+      auto now = td::Time::now();
+      if (flood_controls_.size() >= MAX_IP_FLOOD_CONTROL_COUNT && flood_controls_.count(ip_address) == 0) {
+        evict_flood_control();
+      }
+      auto &ip_flood_control = flood_controls_[ip_address];
+      auto &flood_control = ip_flood_control.flood_control_;
+      if (ip_flood_control.last_event_time_ == 0.0) {
+        ip_flood_control.ip_address_ = ip_address;
         flood_control.add_limit(60, 20);        // 20 in a minute
         flood_control.add_limit(60 * 60, 600);  // 600 in an hour
       }
-      auto now = td::Time::now();
       auto wakeup_at = flood_control.get_wakeup_at();
       if (wakeup_at > now) {
         LOG(INFO) << "Failed to create Client from IP address " << ip_address << " with token";
         return query->set_retry_after_error(static_cast<int>(wakeup_at - now) + 1);
       }
       flood_control.add_event(now);
+      ip_flood_control.last_event_time_ = now;
+      ip_flood_control.remove();
+      flood_control_lru_.put(&ip_flood_control);
     }
     if (is_global_flood_control_enabled_) {
       auto now = td::Time::now();
@@ -153,11 +162,17 @@ void ClientManager::send(PromisedQueryPtr query) {
 
     std::tie(id_it, std::ignore) = token_to_id_.emplace(token, id);
   }
+
+  if (!query_capture_id_.empty() && !query->is_internal()) {
+    send_closure(query_capture_id_, &QueryCaptureActor::add_query, td::crc64(token),
+                 QueryCaptureActor::serialize_query(*query));
+  }
   send_closure(clients_.get(id_it->second)->client_, &Client::send,
                std::move(query));  // will send 429 if the client is already closed
 }
 
-ClientManager::TopClients ClientManager::get_top_clients(std::size_t max_count, td::Slice token_filter) {
+ClientManager::TopClients ClientManager::get_top_clients(std::size_t max_count, td::Slice token_filter,
+                                                         TopClientsOrder order) {
   auto now = td::Time::now();
   TopClients result;
   td::vector<std::pair<td::int64, td::uint64>> top_client_ids;
@@ -173,7 +188,20 @@ ClientManager::TopClients ClientManager::get_top_clients(std::size_t max_count,
       continue;
     }
 
-    auto score = static_cast<td::int64>(client_info->stat_.get_score(now) * -1e9);
+    td::int64 score = 0;
+    switch (order) {
+      case TopClientsOrder::Load:
+        score = static_cast<td::int64>(client_info->stat_.get_score(now) * -1e9);
+        break;
+      case TopClientsOrder::CpuTime:
+        score = static_cast<td::int64>(client_info->stat_.get_cpu_score(now) * -1e9);
+        break;
+      case TopClientsOrder::Memory:
+        score = -static_cast<td::int64>(get_memory_usage(client_info).get_total());
+        break;
+      default:
+        UNREACHABLE();
+    }
     if (score == 0 && top_client_ids.size() >= max_count) {
       continue;
     }
@@ -190,6 +218,13 @@ ClientManager::TopClients ClientManager::get_top_clients(std::size_t max_count,
   return result;
 }
 
+ServerBotMemoryUsage ClientManager::get_memory_usage(ClientInfo *client_info) {
+  auto res = client_info->client_.get_actor_unsafe()->get_memory_usage();
+  res.webhook_update_bytes_ = static_cast<std::size_t>(client_info->stat_.get_webhook_state().loaded_update_bytes_);
+  res.file_upload_bytes_ = static_cast<std::size_t>(client_info->stat_.get_active_file_upload_bytes());
+  return res;
+}
+
 void ClientManager::get_stats(td::Promise<td::BufferSlice> promise,
                               td::vector<std::pair<td::string, td::string>> args) {
   if (close_flag_) {
@@ -198,11 +233,15 @@ void ClientManager::get_stats(td::Promise<td::BufferSlice> promise,
   }
   size_t buf_size = 1 << 14;
   auto buf = td::StackAllocator::alloc(buf_size);
-  td::StringBuilder sb(buf.as_slice());
+  td::StringBuilder sb(buf.as_slice(), true);
 
   td::Slice id_filter;
   int new_verbosity_level = -1;
   td::string tag;
+  bool need_query_traces = false;
+  bool need_serialization_stats = false;
+  bool need_scheduler_stats = false;
+  auto order = TopClientsOrder::Load;
   for (auto &arg : args) {
     if (arg.first == "id") {
       id_filter = arg.second;
@@ -216,6 +255,22 @@ void ClientManager::get_stats(td::Promise<td::BufferSlice> promise,
     if (arg.first == "tag") {
       tag = arg.second;
     }
+    if (arg.first == "traces") {
+      need_query_traces = true;
+    }
+    if (arg.first == "serialization") {
+      need_serialization_stats = true;
+    }
+    if (arg.first == "schedulers") {
+      need_scheduler_stats = true;
+    }
+    if (arg.first == "sort") {
+      if (arg.second == "cpu") {
+        order = TopClientsOrder::CpuTime;
+      } else if (arg.second == "memory") {
+        order = TopClientsOrder::Memory;
+      }
+    }
   }
   if (new_verbosity_level > 0) {
     if (tag.empty()) {
@@ -226,7 +281,7 @@ void ClientManager::get_stats(td::Promise<td::BufferSlice> promise,
   }
 
   auto now = td::Time::now();
-  auto top_clients = get_top_clients(50, id_filter);
+  auto top_clients = get_top_clients(50, id_filter, order);
   sb << BotStatActor::get_description() << '\n';
   if (id_filter.empty()) {
     sb << "uptime\t" << now - parameters_->start_time_ << '\n';
@@ -248,14 +303,59 @@ void ClientManager::get_stats(td::Promise<td::BufferSlice> promise,
       sb << stat.key_ << "\t" << stat.value_ << '\n';
     }
 
+    if (need_scheduler_stats) {
+      auto scheduler_stats = ServerSchedulerStat::instance().as_vector(td::Time::now());
+      for (auto &stat : scheduler_stats) {
+        sb << stat.key_ << "\t" << stat.value_ << '\n';
+      }
+    }
+
     sb << "buffer_memory\t" << td::format::as_size(td::BufferAllocator::get_buffer_mem()) << '\n';
     sb << "active_webhook_connections\t" << WebhookActor::get_total_connection_count() << '\n';
     sb << "active_requests\t" << parameters_->shared_data_->query_count_.load(std::memory_order_relaxed) << '\n';
     sb << "active_network_queries\t" << td::get_pending_network_query_count(*parameters_->net_query_stats_) << '\n';
+    sb << "ip_flood_control_count\t" << flood_controls_.size() << '\n';
+    sb << "is_overloaded\t" << parameters_->shared_data_->is_overloaded_.load(std::memory_order_relaxed) << '\n';
+    sb << "rejected_request_count\t"
+       << parameters_->shared_data_->rejected_query_count_.load(std::memory_order_relaxed) << '\n';
+
+    std::size_t tqueue_event_count = 0;
+    for (auto id : clients_.ids()) {
+      tqueue_event_count += parameters_->shared_data_->tqueue_->get_size(clients_.get(id)->tqueue_id_);
+    }
+    sb << "tqueue_event_count\t" << tqueue_event_count << '\n';
+    sb << "tqueue_loaded_event_count\t" << tqueue_loaded_events_ << '\n';
+    sb << "tqueue_load_time\t" << tqueue_load_time_ << '\n';
+    if (tqueue_loaded_events_ != 0) {
+      sb << "tqueue_load_time_per_million_events\t"
+         << tqueue_load_time_ * 1e6 / static_cast<double>(tqueue_loaded_events_) << '\n';
+    }
+    sb << "tqueue_gc_count\t" << tqueue_gc_count_ << '\n';
+    sb << "tqueue_gc_deleted_event_count\t" << tqueue_deleted_events_ << '\n';
+    if (tqueue_gc_count_ != 0) {
+      sb << "tqueue_gc_average_pause\t" << tqueue_gc_total_time_ / static_cast<double>(tqueue_gc_count_) << '\n';
+      sb << "tqueue_gc_max_pause\t" << tqueue_gc_max_time_ << '\n';
+    }
     auto stats = stat_.as_vector(now);
     for (auto &stat : stats) {
       sb << stat.key_ << "\t" << stat.value_ << '\n';
     }
+
+    for (auto &stat : SlowQueryLog::instance().as_vector()) {
+      sb << stat.key_ << "\t" << stat.value_ << '\n';
+    }
+
+    if (need_query_traces) {
+      for (auto &trace : QueryTraceBuffer::instance().get_traces()) {
+        sb << "slow_query\t" << trace << '\n';
+      }
+    }
+
+    if (need_serialization_stats) {
+      for (auto &stat : SerializationStat::instance().as_vector()) {
+        sb << stat.key_ << "\t" << stat.value_ << '\n';
+      }
+    }
   }
 
   for (auto top_client_id : top_clients.top_client_ids) {
@@ -288,17 +388,42 @@ void ClientManager::get_stats(td::Promise<td::BufferSlice> promise,
       if (bot_info.webhook_max_connections_ != parameters_->default_max_webhook_connections_) {
         sb << "webhook_max_connections\t" << bot_info.webhook_max_connections_ << '\n';
       }
+      const auto &webhook_state = client_info->stat_.get_webhook_state();
+      sb << "webhook_open_connection_count\t" << webhook_state.connection_count_ << '\n';
+      sb << "webhook_idle_connection_count\t" << webhook_state.idle_connection_count_ << '\n';
+      sb << "webhook_connecting_count\t" << webhook_state.connecting_count_ << '\n';
+      sb << "webhook_in_flight_update_count\t" << webhook_state.in_flight_update_count_ << '\n';
+      sb << "webhook_loaded_update_count\t" << webhook_state.loaded_update_count_ << '\n';
+      if (webhook_state.oldest_update_load_time_ > 0) {
+        sb << "webhook_oldest_update_time_since_load\t" << now - webhook_state.oldest_update_load_time_ << '\n';
+      }
     }
     sb << "head_update_id\t" << bot_info.head_update_id_ << '\n';
     if (bot_info.pending_update_count_ != 0) {
       sb << "tail_update_id\t" << bot_info.tail_update_id_ << '\n';
       sb << "pending_update_count\t" << bot_info.pending_update_count_ << '\n';
     }
+    auto reply_markup_count = bot_info.reply_markup_cache_hit_count_ + bot_info.reply_markup_cache_miss_count_;
+    if (reply_markup_count != 0) {
+      sb << "reply_markup_cache_hit_rate\t"
+         << static_cast<double>(bot_info.reply_markup_cache_hit_count_) / static_cast<double>(reply_markup_count)
+         << '\n';
+    }
+    for (auto &stat : get_memory_usage(client_info).as_vector()) {
+      sb << stat.key_ << "\t" << stat.value_ << '\n';
+    }
 
     auto stats = client_info->stat_.as_vector(now);
     for (auto &stat : stats) {
-      if (stat.key_ == "update_count" || stat.key_ == "request_count") {
-        sb << stat.key_ << "/sec\t" << stat.value_ << '\n';
+      if (stat.key_ == "update_count" || stat.key_ == "request_count" || stat.key_ == "cpu_time" ||
+          stat.key_ == "serialization_cpu_time" ||
+          (!bot_info.webhook_.empty() && td::begins_with(stat.key_, "webhook_"))) {
+        if (stat.key_ == "webhook_average_delivery_time") {
+          // the only value, which isn't a rate
+          sb << stat.key_ << "\t" << stat.value_ << '\n';
+        } else {
+          sb << stat.key_ << "/sec\t" << stat.value_ << '\n';
+        }
       }
     }
 
@@ -306,7 +431,9 @@ void ClientManager::get_stats(td::Promise<td::BufferSlice> promise,
       break;
     }
   }
-  // ignore sb overflow
+  if (sb.is_error()) {
+    LOG(ERROR) << "Statistics page is truncated";
+  }
   promise.set_value(td::BufferSlice(sb.as_cslice()));
 }
 
@@ -350,8 +477,9 @@ void ClientManager::start_up() {
 
     parameters_->shared_data_->tqueue_ = std::move(tqueue);
 
-    LOG(WARNING) << "Loaded " << loaded_event_count << " TQueue events in " << (td::Time::now() - load_start_time)
-                 << " seconds";
+    tqueue_loaded_events_ = loaded_event_count;
+    tqueue_load_time_ = td::Time::now() - load_start_time;
+    LOG(WARNING) << "Loaded " << loaded_event_count << " TQueue events in " << tqueue_load_time_ << " seconds";
     next_tqueue_gc_time_ = td::Time::now() + 600;
   }
 
@@ -374,6 +502,11 @@ void ClientManager::start_up() {
     send_closure_later(actor_id(this), &ClientManager::send, std::move(query));
   }
 
+  if (!parameters_->query_capture_path_.empty()) {
+    query_capture_id_ = td::create_actor_on_scheduler<QueryCaptureActor>(
+        "QueryCaptureActor", SharedData::get_file_gc_scheduler_id(), parameters_->query_capture_path_);
+  }
+
   // launch watchdog
   watchdog_id_ = td::create_actor_on_scheduler<Watchdog>("ManagerWatchdog", SharedData::get_watchdog_scheduler_id(),
                                                          td::this_thread::get_id(), WATCHDOG_TIMEOUT);
@@ -491,10 +624,19 @@ void ClientManager::dump_statistics() {
     }
   }
 
+  auto query_traces = QueryTraceBuffer::instance().get_traces();
+  if (!query_traces.empty()) {
+    LOG(WARNING) << "Last " << query_traces.size() << " slow traced queries:";
+    for (auto &trace : query_traces) {
+      LOG(WARNING) << trace;
+    }
+  }
+
   td::dump_pending_network_queries(*parameters_->net_query_stats_);
 
   auto now = td::Time::now();
-  auto top_clients = get_top_clients(10, {});
+  auto top_clients = get_top_clients(
+      10, {}, parameters_->shared_data_->need_cpu_time_stats_ ? TopClientsOrder::CpuTime : TopClientsOrder::Load);
   for (auto top_client_id : top_clients.top_client_ids) {
     auto *client_info = clients_.get(top_client_id);
     CHECK(client_info);
@@ -502,6 +644,7 @@ void ClientManager::dump_statistics() {
     auto bot_info = client_info->client_.get_actor_unsafe()->get_bot_info();
     td::string update_count;
     td::string request_count;
+    td::string cpu_time;
     auto replace_tabs = [](td::string &str) {
       for (auto &c : str) {
         if (c == '\t') {
@@ -519,9 +662,14 @@ void ClientManager::dump_statistics() {
         replace_tabs(stat.value_);
         request_count = std::move(stat.value_);
       }
+      if (stat.key_ == "cpu_time") {
+        replace_tabs(stat.value_);
+        cpu_time = std::move(stat.value_);
+      }
     }
     LOG(WARNING) << td::tag("id", bot_info.id_) << td::tag("update_count", update_count)
-                 << td::tag("request_count", request_count);
+                 << td::tag("request_count", request_count) << td::tag("cpu_time", cpu_time)
+                 << td::tag("memory", td::format::as_size(get_memory_usage(client_info).get_total()));
   }
 }
 
@@ -541,20 +689,87 @@ void ClientManager::raw_event(const td::Event::Raw &event) {
   }
 }
 
+void ClientManager::update_overload_state(double now) {
+  auto &shared_data = parameters_->shared_data_;
+  bool was_overloaded = shared_data->is_overloaded_.load(std::memory_order_relaxed);
+  // the overloaded state is left only after the load drops to a half of the limits to avoid flapping
+  double limit_multiplier = was_overloaded ? 0.5 : 1.0;
+  bool is_overloaded = false;
+  if (shared_data->max_client_scheduler_lag_ > 0 &&
+      ServerSchedulerStat::instance().get_recent_lag(SharedData::get_client_scheduler_id(), now) >
+          shared_data->max_client_scheduler_lag_ * limit_multiplier) {
+    is_overloaded = true;
+  }
+  if (shared_data->max_pending_network_query_count_ > 0 &&
+      static_cast<double>(td::get_pending_network_query_count(*parameters_->net_query_stats_)) >
+          static_cast<double>(shared_data->max_pending_network_query_count_) * limit_multiplier) {
+    is_overloaded = true;
+  }
+  if (was_overloaded && !is_overloaded && now < overload_start_time_ + MIN_OVERLOAD_TIME) {
+    is_overloaded = true;
+  }
+  if (is_overloaded != was_overloaded) {
+    if (is_overloaded) {
+      LOG(WARNING) << "Start to reject new requests because of overload";
+      overload_start_time_ = now;
+    } else {
+      LOG(WARNING) << "Stop to reject new requests; rejected "
+                   << shared_data->rejected_query_count_.load(std::memory_order_relaxed) << " requests in total";
+    }
+    shared_data->is_overloaded_.store(is_overloaded, std::memory_order_relaxed);
+  }
+}
+
+void ClientManager::prune_flood_controls(double now) {
+  last_flood_control_prune_time_ = now;
+  auto old_size = flood_controls_.size();
+  while (!flood_control_lru_.empty()) {
+    auto ip_flood_control = static_cast<IpFloodControl *>(flood_control_lru_.get());
+    if (ip_flood_control->last_event_time_ >= now - IP_FLOOD_CONTROL_EXPIRE_TIME) {
+      flood_control_lru_.put_back(ip_flood_control);
+      break;
+    }
+    auto ip_address = std::move(ip_flood_control->ip_address_);
+    flood_controls_.erase(ip_address);
+  }
+  LOG(INFO) << "Removed " << old_size - flood_controls_.size() << " expired IP flood controls";
+}
+
+void ClientManager::evict_flood_control() {
+  // forget the least recently used flood control to make room for a new IP address
+  auto ip_flood_control = static_cast<IpFloodControl *>(flood_control_lru_.get());
+  CHECK(ip_flood_control != nullptr);
+  auto ip_address = std::move(ip_flood_control->ip_address_);
+  LOG(INFO) << "Evict Client creation flood control for IP address " << ip_address;
+  flood_controls_.erase(ip_address);
+}
+
 void ClientManager::timeout_expired() {
   send_closure(watchdog_id_, &Watchdog::kick);
   set_timeout_in(WATCHDOG_TIMEOUT / 10);
 
   double now = td::Time::now();
+  if (now >= next_overload_check_time_) {
+    next_overload_check_time_ = now + OVERLOAD_CHECK_PERIOD;
+    update_overload_state(now);
+  }
+  if (now >= last_flood_control_prune_time_ + IP_FLOOD_CONTROL_PRUNE_PERIOD) {
+    prune_flood_controls(now);
+  }
   if (now > next_tqueue_gc_time_) {
     auto unix_time = parameters_->shared_data_->get_unix_time(now);
     LOG(INFO) << "Run TQueue GC at " << unix_time;
     td::int64 deleted_events;
     bool is_finished;
     std::tie(deleted_events, is_finished) = parameters_->shared_data_->tqueue_->run_gc(unix_time);
-    LOG(INFO) << "TQueue GC deleted " << deleted_events << " events";
+    auto gc_time = td::Time::now() - now;
+    LOG(INFO) << "TQueue GC deleted " << deleted_events << " events in " << gc_time << " seconds";
     next_tqueue_gc_time_ = td::Time::now() + (is_finished ? 60.0 : 1.0);
 
+    tqueue_gc_count_++;
+    tqueue_gc_total_time_ += gc_time;
+    tqueue_gc_max_time_ = td::max(tqueue_gc_max_time_, gc_time);
+
     tqueue_deleted_events_ += deleted_events;
     if (tqueue_deleted_events_ > last_tqueue_deleted_events_ + 10000) {
       LOG(WARNING) << "TQueue GC already deleted " << tqueue_deleted_events_ << " events since the start";
@@ -585,6 +800,7 @@ void ClientManager::hangup_shared() {
 
 void ClientManager::close_db() {
   LOG(WARNING) << "Closing databases";
+  query_capture_id_.reset();
   td::MultiPromiseActorSafe mpas("close binlogs");
   mpas.add_promise(td::PromiseCreator::lambda(
       [actor_id = actor_id(this)](td::Unit) { send_closure(actor_id, &ClientManager::finish_close); }));
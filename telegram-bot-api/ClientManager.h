@@ -8,6 +8,7 @@
 
 #include "telegram-bot-api/Client.h"
 #include "telegram-bot-api/Query.h"
+#include "telegram-bot-api/QueryCaptureActor.h"
 #include "telegram-bot-api/Stats.h"
 #include "telegram-bot-api/Watchdog.h"
 
@@ -18,6 +19,7 @@
 #include "td/utils/Container.h"
 #include "td/utils/FlatHashMap.h"
 #include "td/utils/FloodControlFast.h"
+#include "td/utils/List.h"
 #include "td/utils/Promise.h"
 #include "td/utils/Slice.h"
 
@@ -65,7 +67,14 @@ class ClientManager final : public td::Actor {
   TokenRange token_range_;
 
   td::FlatHashMap<td::string, td::uint64> token_to_id_;
-  td::FlatHashMap<td::string, td::FloodControlFast> flood_controls_;
+  struct IpFloodControl final : public td::ListNode {
+    td::string ip_address_;
+    td::FloodControlFast flood_control_;
+    double last_event_time_ = 0.0;
+  };
+  td::ListNode flood_control_lru_;  // used IP flood controls, the most recently used first
+  td::FlatHashMap<td::string, IpFloodControl> flood_controls_;  // IP address -> Client creation flood control
+  double last_flood_control_prune_time_ = 0.0;
   td::FloodControlFast global_flood_control_;
   bool is_global_flood_control_enabled_ = false;
   td::FlatHashMap<td::int64, td::uint64> active_client_count_;
@@ -74,11 +83,26 @@ class ClientManager final : public td::Actor {
   td::vector<td::Promise<td::Unit>> close_promises_;
 
   td::ActorOwn<Watchdog> watchdog_id_;
+  td::ActorOwn<QueryCaptureActor> query_capture_id_;
   double next_tqueue_gc_time_ = 0.0;
   td::int64 tqueue_deleted_events_ = 0;
   td::int64 last_tqueue_deleted_events_ = 0;
+  td::int64 tqueue_loaded_events_ = 0;
+  double tqueue_load_time_ = 0.0;
+  td::int64 tqueue_gc_count_ = 0;
+  double tqueue_gc_total_time_ = 0.0;
+  double tqueue_gc_max_time_ = 0.0;
+  double next_overload_check_time_ = 0.0;
+  double overload_start_time_ = 0.0;
 
   static constexpr double WATCHDOG_TIMEOUT = 0.25;
+  static constexpr double OVERLOAD_CHECK_PERIOD = 0.1;
+  static constexpr double MIN_OVERLOAD_TIME = 5.0;
+
+  // an IP flood control can be forgotten after the longest period of its limits without events
+  static constexpr double IP_FLOOD_CONTROL_EXPIRE_TIME = 60 * 60;
+  static constexpr double IP_FLOOD_CONTROL_PRUNE_PERIOD = 60;
+  static constexpr std::size_t MAX_IP_FLOOD_CONTROL_COUNT = 100000;
 
   static td::int64 get_tqueue_id(td::int64 user_id, bool is_test_dc);
 
@@ -89,7 +113,16 @@ class ClientManager final : public td::Actor {
     td::int32 active_count = 0;
     td::vector<td::uint64> top_client_ids;
   };
-  TopClients get_top_clients(std::size_t max_count, td::Slice token_filter);
+  enum class TopClientsOrder : td::int32 { Load, CpuTime, Memory };
+  TopClients get_top_clients(std::size_t max_count, td::Slice token_filter, TopClientsOrder order);
+
+  static ServerBotMemoryUsage get_memory_usage(ClientInfo *client_info);
+
+  void update_overload_state(double now);
+
+  void prune_flood_controls(double now);
+
+  void evict_flood_control();
 
   void start_up() final;
   void raw_event(const td::Event::Raw &event) final;
@@ -16,6 +16,7 @@
 #include "td/utils/common.h"
 #include "td/utils/List.h"
 #include "td/utils/port/IPAddress.h"
+#include "td/utils/Slice.h"
 
 #include <atomic>
 #include <limits>
@@ -39,6 +40,25 @@ struct SharedData {
 
   double unix_time_difference_{-1e100};
 
+  // one of every query_trace_rate_ API requests is traced; 0 disables tracing
+  td::int32 query_trace_rate_ = 0;
+
+  // all API requests are traced and the ones processed longer are logged; 0 disables the slow query log
+  double slow_query_threshold_ = 0;
+
+  // CPU time spent by bots is measured; requires a few system calls for each request and update
+  bool need_cpu_time_stats_ = false;
+
+  // responses of at least min_compressed_response_size_ bytes are gzipped if the client accepts it; 0 disables
+  size_t min_compressed_response_size_ = 0;
+
+  // new requests are rejected after average lag of the client scheduler or the number of pending network queries
+  // exceeds the limit until both of them drop below a half of their limits; 0 disables the check
+  double max_client_scheduler_lag_ = 0;
+  td::uint64 max_pending_network_query_count_ = 0;
+  std::atomic<bool> is_overloaded_{false};
+  std::atomic<td::uint64> rejected_query_count_{0};
+
   static constexpr size_t TQUEUE_EVENT_BUFFER_SIZE = 1000;
   td::TQueue::Event event_buffer_[TQUEUE_EVENT_BUFFER_SIZE];
 
@@ -98,9 +118,52 @@ struct SharedData {
     return 11;
   }
 
-  static td::int32 get_thread_count() {
+  static td::int32 get_response_compression_scheduler_id() {
+    // the thread for compression of responses
     return 12;
   }
+
+  static td::int32 get_thread_count() {
+    return 13;
+  }
+
+  static td::Slice get_scheduler_name(td::int32 scheduler_id) {
+    if (scheduler_id == 0) {
+      return td::Slice("main");
+    }
+    if (scheduler_id == get_file_gc_scheduler_id()) {
+      return td::Slice("file_gc");
+    }
+    if (scheduler_id == get_client_scheduler_id()) {
+      return td::Slice("client");
+    }
+    if (scheduler_id == get_watchdog_scheduler_id()) {
+      return td::Slice("watchdog");
+    }
+    if (scheduler_id == get_slow_incoming_http_scheduler_id()) {
+      return td::Slice("slow_incoming_http");
+    }
+    if (scheduler_id == get_slow_outgoing_http_scheduler_id()) {
+      return td::Slice("slow_outgoing_http");
+    }
+    if (scheduler_id == get_dns_resolver_scheduler_id()) {
+      return td::Slice("dns_resolver");
+    }
+    if (scheduler_id == get_binlog_scheduler_id()) {
+      return td::Slice("binlog");
+    }
+    if (scheduler_id == get_webhook_certificate_scheduler_id()) {
+      return td::Slice("webhook_certificate");
+    }
+    if (scheduler_id == get_statistics_thread_id()) {
+      return td::Slice("statistics");
+    }
+    if (scheduler_id == get_response_compression_scheduler_id()) {
+      return td::Slice("response_compression");
+    }
+    // the threads used internally by TDLib
+    return td::Slice("td");
+  }
 };
 
 struct ClientParameters {
@@ -117,6 +180,8 @@ struct ClientParameters {
   td::int32 default_max_webhook_connections_ = 0;
   td::IPAddress webhook_proxy_ip_address_;
 
+  td::string query_capture_path_;
+
   double start_time_ = 0;
 
   td::ActorId<td::GetHostByNameActor> get_host_by_name_actor_id_;
@@ -6,19 +6,107 @@
 //
 #include "telegram-bot-api/HttpConnection.h"
 
+#include "telegram-bot-api/ClientParameters.h"
 #include "telegram-bot-api/Query.h"
 
 #include "td/net/HttpHeaderCreator.h"
 
 #include "td/utils/common.h"
+#include "td/utils/Gzip.h"
 #include "td/utils/JsonBuilder.h"
 #include "td/utils/logging.h"
+#include "td/utils/misc.h"
 #include "td/utils/Parser.h"
 #include "td/utils/Promise.h"
 #include "td/utils/SliceBuilder.h"
 
+#include <tuple>
+
 namespace telegram_bot_api {
 
+static void write_response(td::ActorOwn<td::HttpInboundConnection> connection, int http_status_code,
+                           td::BufferSlice &&content, int retry_after, bool is_gzipped, bool need_vary_header) {
+  td::HttpHeaderCreator hc;
+  hc.init_status_line(http_status_code);
+  hc.set_keep_alive();
+  hc.set_content_type("application/json");
+  if (is_gzipped) {
+    hc.add_header("Content-Encoding", "gzip");
+  }
+  if (need_vary_header) {
+    // the response could have been compressed for another Accept-Encoding, so caches must not mix the variants
+    hc.add_header("Vary", "Accept-Encoding");
+  }
+  if (retry_after > 0) {
+    hc.add_header("Retry-After", PSLICE() << retry_after);
+  }
+  hc.set_content_size(content.size());
+
+  auto r_header = hc.finish();
+  LOG(DEBUG) << "Response headers: " << r_header.ok();
+  if (r_header.is_error()) {
+    LOG(ERROR) << "Bad response headers";
+    send_closure(std::move(connection), &td::HttpInboundConnection::write_error, r_header.move_as_error());
+    return;
+  }
+  if (!is_gzipped) {
+    LOG(DEBUG) << "Send result: " << content;
+  }
+
+  send_closure(connection, &td::HttpInboundConnection::write_next_noflush, td::BufferSlice(r_header.ok()));
+  send_closure(connection, &td::HttpInboundConnection::write_next_noflush, std::move(content));
+  send_closure(std::move(connection), &td::HttpInboundConnection::write_ok);
+}
+
+#if TD_HAVE_ZLIB
+// compresses a response and sends it to the connection; runs on a separate scheduler, so that compression of large
+// responses doesn't delay processing of incoming HTTP connections
+class HttpResponseCompressor final : public td::Actor {
+ public:
+  HttpResponseCompressor(td::ActorOwn<td::HttpInboundConnection> connection, int http_status_code,
+                         td::BufferSlice content, int retry_after)
+      : connection_(std::move(connection))
+      , http_status_code_(http_status_code)
+      , content_(std::move(content))
+      , retry_after_(retry_after) {
+  }
+
+ private:
+  td::ActorOwn<td::HttpInboundConnection> connection_;
+  int http_status_code_;
+  td::BufferSlice content_;
+  int retry_after_;
+
+  void start_up() final {
+    // send the response as is if it can't be compressed at least by 10%
+    auto compressed_content = td::gzencode(content_.as_slice(), 0.9);
+    if (compressed_content.empty()) {
+      write_response(std::move(connection_), http_status_code_, std::move(content_), retry_after_, false, true);
+    } else {
+      write_response(std::move(connection_), http_status_code_, std::move(compressed_content), retry_after_, true,
+                     true);
+    }
+    stop();
+  }
+};
+#endif
+
+static bool is_gzip_accepted(td::Slice accept_encoding) {
+  for (auto coding : td::full_split(accept_encoding, ',')) {
+    td::Slice parameters;
+    std::tie(coding, parameters) = td::split(coding, ';');
+    if (td::to_lower(td::trim(coding)) != "gzip") {
+      continue;
+    }
+    parameters = td::trim(parameters);
+    if (td::begins_with(parameters, "q=")) {
+      return td::to_double(parameters.substr(2)) > 0;
+    }
+    return true;
+  }
+  return false;
+}
+
 void HttpConnection::handle(td::unique_ptr<td::HttpQuery> http_query,
                             td::ActorOwn<td::HttpInboundConnection> connection) {
   CHECK(connection_.empty());
@@ -48,11 +136,20 @@ void HttpConnection::handle(td::unique_ptr<td::HttpQuery> http_query,
   auto query = td::make_unique<Query>(std::move(http_query->container_), token, is_test_dc, method,
                                       std::move(http_query->args_), std::move(http_query->headers_),
                                       std::move(http_query->files_), shared_data_, http_query->peer_address_, false);
+  if (!unix_socket_peer_.empty()) {
+    // any local process can connect to the socket and specify any x-real-ip, so the peer user is used instead
+    query->set_unix_socket_peer(unix_socket_peer_);
+  }
 
   auto promise = td::PromiseCreator::lambda([actor_id = actor_id(this)](td::Result<td::unique_ptr<Query>> r_query) {
     send_closure(actor_id, &HttpConnection::on_query_finished, std::move(r_query));
   });
   auto promised_query = PromisedQueryPtr(query.release(), PromiseDeleter(std::move(promise)));
+  // getUpdates must be served even under overload, because it acknowledges already received updates
+  if (shared_data_->is_overloaded_.load(std::memory_order_relaxed) && promised_query->method() != "getupdates") {
+    shared_data_->rejected_query_count_.fetch_add(1, std::memory_order_relaxed);
+    return promised_query->set_retry_after_error(1);
+  }
   send_closure(client_manager_, &ClientManager::send, std::move(promised_query));
 }
 
@@ -60,35 +157,36 @@ void HttpConnection::on_query_finished(td::Result<td::unique_ptr<Query>> r_query
   LOG_CHECK(r_query.is_ok()) << r_query.error();
 
   auto query = r_query.move_as_ok();
-  send_response(query->http_status_code(), std::move(query->answer()), query->retry_after());
+  auto min_compressed_size = shared_data_->min_compressed_response_size_;
+  bool is_compression_enabled = min_compressed_size > 0;
+  bool can_compress = is_compression_enabled && query->answer().size() >= min_compressed_size &&
+                      is_gzip_accepted(query->get_header("accept-encoding"));
+  send_response(query->http_status_code(), std::move(query->answer()), query->retry_after(), can_compress,
+                is_compression_enabled);
+  query->set_stage(Query::Stage::Responded);
 }
 
-void HttpConnection::send_response(int http_status_code, td::BufferSlice &&content, int retry_after) {
-  td::HttpHeaderCreator hc;
-  hc.init_status_line(http_status_code);
-  hc.set_keep_alive();
-  hc.set_content_type("application/json");
-  if (retry_after > 0) {
-    hc.add_header("Retry-After", PSLICE() << retry_after);
-  }
-  hc.set_content_size(content.size());
-
-  auto r_header = hc.finish();
-  LOG(DEBUG) << "Response headers: " << r_header.ok();
-  if (r_header.is_error()) {
-    LOG(ERROR) << "Bad response headers";
-    send_closure(std::move(connection_), &td::HttpInboundConnection::write_error, r_header.move_as_error());
+void HttpConnection::send_response(int http_status_code, td::BufferSlice &&content, int retry_after,
+                                   bool can_compress, bool is_compression_enabled) {
+#if TD_HAVE_ZLIB
+  if (can_compress) {
+    td::create_actor_on_scheduler<HttpResponseCompressor>(
+        "HttpResponseCompressor", SharedData::get_response_compression_scheduler_id(), std::move(connection_),
+        http_status_code, std::move(content), retry_after)
+        .release();
     return;
   }
-  LOG(DEBUG) << "Send result: " << content;
-
-  send_closure(connection_, &td::HttpInboundConnection::write_next_noflush, td::BufferSlice(r_header.ok()));
-  send_closure(connection_, &td::HttpInboundConnection::write_next_noflush, std::move(content));
-  send_closure(std::move(connection_), &td::HttpInboundConnection::write_ok);
+  bool need_vary_header = is_compression_enabled;
+#else
+  bool need_vary_header = false;
+#endif
+  write_response(std::move(connection_), http_status_code, std::move(content), retry_after, false,
+                 need_vary_header);
 }
 
 void HttpConnection::send_http_error(int http_status_code, td::Slice description) {
-  send_response(http_status_code, td::json_encode<td::BufferSlice>(JsonQueryError(http_status_code, description)), 0);
+  send_response(http_status_code, td::json_encode<td::BufferSlice>(JsonQueryError(http_status_code, description)), 0,
+                false, false);
 }
 
 }  // namespace telegram_bot_api
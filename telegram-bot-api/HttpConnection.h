@@ -15,6 +15,7 @@
 #include "td/actor/actor.h"
 
 #include "td/utils/buffer.h"
+#include "td/utils/common.h"
 #include "td/utils/Slice.h"
 #include "td/utils/Status.h"
 
@@ -26,8 +27,11 @@ struct SharedData;
 
 class HttpConnection final : public td::HttpInboundConnection::Callback {
  public:
-  HttpConnection(td::ActorId<ClientManager> client_manager, std::shared_ptr<SharedData> shared_data)
-      : client_manager_(client_manager), shared_data_(std::move(shared_data)) {
+  HttpConnection(td::ActorId<ClientManager> client_manager, std::shared_ptr<SharedData> shared_data,
+                 td::string unix_socket_peer)
+      : client_manager_(client_manager)
+      , shared_data_(std::move(shared_data))
+      , unix_socket_peer_(std::move(unix_socket_peer)) {
   }
 
   void handle(td::unique_ptr<td::HttpQuery> http_query, td::ActorOwn<td::HttpInboundConnection> connection) final;
@@ -36,6 +40,7 @@ class HttpConnection final : public td::HttpInboundConnection::Callback {
   td::ActorId<ClientManager> client_manager_;
   td::ActorOwn<td::HttpInboundConnection> connection_;
   std::shared_ptr<SharedData> shared_data_;
+  td::string unix_socket_peer_;  // empty for TCP connections
 
   void hangup() final {
     connection_.release();
@@ -44,7 +49,8 @@ class HttpConnection final : public td::HttpInboundConnection::Callback {
 
   void on_query_finished(td::Result<td::unique_ptr<Query>> r_query);
 
-  void send_response(int http_status_code, td::BufferSlice &&content, int retry_after);
+  void send_response(int http_status_code, td::BufferSlice &&content, int retry_after, bool can_compress,
+                     bool is_compression_enabled);
 
   void send_http_error(int http_status_code, td::Slice description);
 };
@@ -7,6 +7,7 @@
 #pragma once
 
 #include "telegram-bot-api/ClientParameters.h"
+#include "telegram-bot-api/UnixSocketListener.h"
 
 #include "td/net/HttpInboundConnection.h"
 #include "td/net/TcpListener.h"
@@ -35,11 +36,21 @@ class HttpServer final : public td::TcpListener::Callback {
     flood_control_.add_limit(60, 10);  // 10 in a minute
   }
 
+  // the creator receives a name of the connected peer, which is based on its user identifier
+  HttpServer(td::string unix_socket_path,
+             std::function<td::ActorOwn<td::HttpInboundConnection::Callback>(td::string)> creator)
+      : HttpServer(td::string(), 0, nullptr) {
+    unix_socket_path_ = std::move(unix_socket_path);
+    unix_socket_creator_ = std::move(creator);
+  }
+
  private:
   td::string ip_address_;
   td::int32 port_;
+  td::string unix_socket_path_;
   std::function<td::ActorOwn<td::HttpInboundConnection::Callback>()> creator_;
-  td::ActorOwn<td::TcpListener> listener_;
+  std::function<td::ActorOwn<td::HttpInboundConnection::Callback>(td::string)> unix_socket_creator_;
+  td::ActorOwn<td::Actor> listener_;
   td::FloodControlFast flood_control_;
 
   void start_up() final {
@@ -50,6 +61,13 @@ class HttpServer final : public td::TcpListener::Callback {
       return;
     }
     flood_control_.add_event(now);
+    if (!unix_socket_path_.empty()) {
+      LOG(INFO) << "Create Unix socket listener " << td::tag("path", unix_socket_path_);
+      listener_ = td::create_actor<UnixSocketListener>(
+          PSLICE() << "UnixSocketListener" << td::tag("path", unix_socket_path_), unix_socket_path_,
+          actor_shared(this, 1));
+      return;
+    }
     LOG(INFO) << "Create TCP listener " << td::tag("address", ip_address_) << td::tag("port", port_);
     listener_ = td::create_actor<td::TcpListener>(
         PSLICE() << "TcpListener" << td::tag("address", ip_address_) << td::tag("port", port_), port_,
@@ -57,14 +75,17 @@ class HttpServer final : public td::TcpListener::Callback {
   }
 
   void hangup_shared() final {
-    LOG(ERROR) << "TCP listener was closed";
+    LOG(ERROR) << (unix_socket_path_.empty() ? "TCP" : "Unix socket") << " listener was closed";
     listener_.release();
     yield();
   }
 
   void accept(td::SocketFd fd) final {
+    auto callback = unix_socket_path_.empty() ? creator_()
+                                              : unix_socket_creator_(UnixSocketListener::get_peer_name(fd));
     td::create_actor<td::HttpInboundConnection>("HttpInboundConnection", td::BufferedFd<td::SocketFd>(std::move(fd)), 0,
-                                                50, 500, creator_(), SharedData::get_slow_incoming_http_scheduler_id())
+                                                50, 500, std::move(callback),
+                                                SharedData::get_slow_incoming_http_scheduler_id())
         .release();
   }
 
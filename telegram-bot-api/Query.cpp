@@ -14,6 +14,7 @@
 #include "td/utils/logging.h"
 #include "td/utils/misc.h"
 #include "td/utils/port/IPAddress.h"
+#include "td/utils/Random.h"
 #include "td/utils/SliceBuilder.h"
 #include "td/utils/Time.h"
 
@@ -45,6 +46,15 @@ Query::Query(td::vector<td::BufferSlice> &&container, td::Slice token, bool is_t
   start_timestamp_ = td::Time::now();
   LOG(INFO) << "Query " << this << ": " << *this;
   if (shared_data_) {
+    auto trace_rate = shared_data_->query_trace_rate_;
+    // long polling getUpdates requests are slow by design and would crowd out other traces
+    if (!is_internal_ && method_ != "getupdates") {
+      if (shared_data_->slow_query_threshold_ > 0) {
+        is_traced_ = true;
+      } else if (trace_rate > 0) {
+        is_traced_ = trace_rate == 1 || td::Random::fast(1, trace_rate) == 1;
+      }
+    }
     shared_data_->query_count_.fetch_add(1, std::memory_order_relaxed);
     if (method_ != "getupdates") {
       shared_data_->query_list_size_.fetch_add(1, std::memory_order_relaxed);
@@ -54,6 +64,9 @@ Query::Query(td::vector<td::BufferSlice> &&container, td::Slice token, bool is_t
 }
 
 td::string Query::get_peer_ip_address() const {
+  if (!unix_socket_peer_.empty()) {
+    return unix_socket_peer_;
+  }
   if (peer_ip_address_.is_valid() && !peer_ip_address_.is_reserved()) {  // external connection
     return peer_ip_address_.get_ip_str().str();
   } else {
@@ -83,12 +96,15 @@ void Query::set_stat_actor(td::ActorId<BotStatActor> stat_actor) {
   send_request_stat();
 }
 
-void Query::set_ok(td::BufferSlice result) {
+void Query::set_ok(td::BufferSlice result, double serialization_cpu_time) {
   CHECK(state_ == State::Query);
   LOG(INFO) << "Query " << this << ": " << td::tag("method", method_) << td::tag("text", result.as_slice());
   answer_ = std::move(result);
+  answer_size_ = answer_.size();
+  serialization_cpu_time_ = serialization_cpu_time;
   state_ = State::OK;
   http_status_code_ = 200;
+  set_stage(Stage::Answered);
   send_response_stat();
 }
 
@@ -97,8 +113,10 @@ void Query::set_error(int http_status_code, td::BufferSlice result) {
             << td::tag("text", result.as_slice());
   CHECK(state_ == State::Query);
   answer_ = std::move(result);
+  answer_size_ = answer_.size();
   state_ = State::Error;
   http_status_code_ = http_status_code;
+  set_stage(Stage::Answered);
   send_response_stat();
 }
 
@@ -138,9 +156,43 @@ td::StringBuilder &operator<<(td::StringBuilder &sb, const Query &query) {
   if (!query.files().empty()) {
     sb << query.files();
   }
+  if (query.is_traced()) {
+    sb << query.get_trace();
+  }
   return sb;
 }
 
+td::string Query::get_trace() const {
+  static constexpr const char *STAGE_NAMES[static_cast<std::size_t>(Stage::Size)] = {
+      "dispatched", "queued", "started", "chat_checked", "send_accepted", "answered", "responded"};
+
+  td::string result = PSTRING() << "[bot" << token_.substr(0, token_.find(':')) << "][method:" << method_
+                                << "][code:" << http_status_code_ << "][size:" << answer_size_ << ']';
+  float previous_time = 0.0;
+  for (std::size_t i = 0; i < static_cast<std::size_t>(Stage::Size); i++) {
+    if (stage_times_[i] <= 0.0) {
+      continue;
+    }
+    result += PSTRING() << '[' << STAGE_NAMES[i] << ":+" << td::format::as_time(stage_times_[i] - previous_time) << ']';
+    previous_time = stage_times_[i];
+  }
+  return result;
+}
+
+void Query::save_trace() const {
+  auto now = td::Time::now();
+  auto duration = now - start_timestamp_;
+  auto slow_query_threshold = shared_data_->slow_query_threshold_;
+  if (duration < (slow_query_threshold > 0 ? slow_query_threshold : DEFAULT_SLOW_QUERY_TRACE_TIME)) {
+    return;
+  }
+  td::string trace = PSTRING() << "[time:" << td::format::as_time(duration) << ']' << get_trace();
+  if (slow_query_threshold > 0) {
+    SlowQueryLog::instance().add_slow_query(method_, trace, now);
+  }
+  QueryTraceBuffer::instance().add_trace(std::move(trace));
+}
+
 void Query::send_request_stat() const {
   if (stat_actor_.empty()) {
     return;
@@ -160,7 +212,9 @@ void Query::send_response_stat() const {
     return;
   }
   send_closure(stat_actor_, &BotStatActor::add_event<ServerBotStat::Response>,
-               ServerBotStat::Response{state_ == State::OK, answer_.size(), file_count(), files_size()}, now);
+               ServerBotStat::Response{state_ == State::OK, answer_.size(), file_count(), files_size(),
+                                       serialization_cpu_time_},
+               now);
 }
 
 }  // namespace telegram_bot_api
@@ -7,6 +7,7 @@
 #pragma once
 
 #include "telegram-bot-api/ClientParameters.h"
+#include "telegram-bot-api/Stats.h"
 
 #include "td/net/HttpFile.h"
 
@@ -21,6 +22,7 @@
 #include "td/utils/Promise.h"
 #include "td/utils/Slice.h"
 #include "td/utils/StringBuilder.h"
+#include "td/utils/Time.h"
 
 #include <algorithm>
 #include <atomic>
@@ -29,12 +31,22 @@
 
 namespace telegram_bot_api {
 
-class BotStatActor;
-
 class Query final : public td::ListNode {
  public:
   enum class State : td::int8 { Query, OK, Error };
 
+  // stages of query processing, which are timed for traced queries
+  enum class Stage : td::int8 {
+    Dispatched,
+    Queued,
+    Started,
+    ChatChecked,
+    SendAccepted,
+    Answered,
+    Responded,
+    Size
+  };
+
   td::Slice token() const {
     return token_;
   }
@@ -80,8 +92,13 @@ class Query final : public td::ListNode {
 
   td::int64 files_size() const;
 
+  // returns the client IP address or "unix:<user identifier>" for connections to a Unix socket
   td::string get_peer_ip_address() const;
 
+  void set_unix_socket_peer(td::string unix_socket_peer) {
+    unix_socket_peer_ = std::move(unix_socket_peer);
+  }
+
   td::BufferSlice &answer() {
     return answer_;
   }
@@ -94,7 +111,7 @@ class Query final : public td::ListNode {
     return retry_after_;
   }
 
-  void set_ok(td::BufferSlice result);
+  void set_ok(td::BufferSlice result, double serialization_cpu_time = 0.0);
 
   void set_error(int http_status_code, td::BufferSlice result);
 
@@ -118,6 +135,9 @@ class Query final : public td::ListNode {
   Query &operator=(Query &&) = delete;
   ~Query() {
     if (shared_data_) {
+      if (is_traced_) {
+        save_trace();
+      }
       shared_data_->query_count_.fetch_sub(1, std::memory_order_relaxed);
       if (!empty()) {
         shared_data_->query_list_size_.fetch_sub(1, std::memory_order_relaxed);
@@ -133,11 +153,32 @@ class Query final : public td::ListNode {
 
   void set_stat_actor(td::ActorId<BotStatActor> stat_actor);
 
+  bool is_traced() const {
+    return is_traced_;
+  }
+
+  bool need_cpu_time_stats() const {
+    return shared_data_ != nullptr && shared_data_->need_cpu_time_stats_;
+  }
+
+  void set_stage(Stage stage) {
+    if (is_traced_) {
+      stage_times_[static_cast<std::size_t>(stage)] = static_cast<float>(td::Time::now() - start_timestamp_);
+    }
+  }
+
+  td::string get_trace() const;
+
  private:
+  static constexpr double DEFAULT_SLOW_QUERY_TRACE_TIME = 0.5;
+
   State state_;
   std::shared_ptr<SharedData> shared_data_;
   double start_timestamp_;
+  bool is_traced_ = false;
+  float stage_times_[static_cast<std::size_t>(Stage::Size)] = {};
   td::IPAddress peer_ip_address_;
+  td::string unix_socket_peer_;
   td::ActorId<BotStatActor> stat_actor_;
 
   // request
@@ -152,6 +193,8 @@ class Query final : public td::ListNode {
 
   // response
   td::BufferSlice answer_;
+  std::size_t answer_size_ = 0;
+  double serialization_cpu_time_ = 0;
   int http_status_code_ = 0;
   int retry_after_ = 0;
 
@@ -167,6 +210,8 @@ class Query final : public td::ListNode {
   void send_request_stat() const;
 
   void send_response_stat() const;
+
+  void save_trace() const;
 };
 
 td::StringBuilder &operator<<(td::StringBuilder &sb, const Query &query);
@@ -264,7 +309,14 @@ using PromisedQueryPtr = std::unique_ptr<Query, PromiseDeleter>;
 
 template <class Jsonable>
 void answer_query(const Jsonable &result, PromisedQueryPtr query, td::Slice description = td::Slice()) {
-  query->set_ok(td::json_encode<td::BufferSlice>(JsonQueryOk<Jsonable>(result, description)));
+  auto start_cpu_time = query->need_cpu_time_stats() ? get_thread_cpu_time() : -1.0;
+  auto answer = td::json_encode<td::BufferSlice>(JsonQueryOk<Jsonable>(result, description));
+  double serialization_cpu_time = 0.0;
+  if (start_cpu_time >= 0) {
+    serialization_cpu_time = td::max(get_thread_cpu_time() - start_cpu_time, 0.0);
+    SerializationStat::instance().add_answer(query->method(), serialization_cpu_time, answer.size());
+  }
+  query->set_ok(std::move(answer), serialization_cpu_time);
   query.reset();  // send query into promise explicitly
 }
 
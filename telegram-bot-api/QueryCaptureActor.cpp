@@ -0,0 +1,120 @@
+//
+// Copyright Aliaksei Levin (levlam@telegram.org), Arseny Smirnov (arseny30@gmail.com) 2014-2025
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#include "telegram-bot-api/QueryCaptureActor.h"
+
+#include "td/utils/logging.h"
+#include "td/utils/misc.h"
+#include "td/utils/Slice.h"
+#include "td/utils/Time.h"
+#include "td/utils/tl_storers.h"
+
+#include <cstring>
+
+namespace telegram_bot_api {
+
+td::BufferSlice QueryCaptureActor::serialize_query(const Query &query) {
+  auto store = [&query](auto &storer) {
+    storer.store_binary(query.start_timestamp());
+    storer.store_binary(static_cast<td::int32>(query.is_test_dc()));
+    storer.store_string(query.method());
+    storer.store_binary(td::narrow_cast<td::int32>(query.args().size()));
+    for (auto &arg : query.args()) {
+      storer.store_string(arg.first);
+      storer.store_binary(td::narrow_cast<td::int32>(arg.second.size()));
+    }
+    storer.store_binary(td::narrow_cast<td::int32>(query.files().size()));
+    for (auto &file : query.files()) {
+      storer.store_string(file.field_name);
+      storer.store_binary(file.size);
+    }
+  };
+
+  td::TlStorerCalcLength storer_calc_length;
+  store(storer_calc_length);
+
+  td::BufferSlice result(storer_calc_length.get_length());
+  td::TlStorerUnsafe storer_unsafe(result.as_mutable_slice().ubegin());
+  store(storer_unsafe);
+  return result;
+}
+
+void QueryCaptureActor::start_up() {
+  auto r_fd = td::FileFd::open(path_, td::FileFd::Write | td::FileFd::Create | td::FileFd::Truncate);
+  if (r_fd.is_error()) {
+    LOG(ERROR) << "Can't open query capture file \"" << path_ << "\": " << r_fd.error();
+    return stop();
+  }
+  fd_ = r_fd.move_as_ok();
+  start_time_ = td::Time::now();
+  append_binary(MAGIC);
+  append_binary(VERSION);
+  LOG(WARNING) << "Start to capture incoming queries to \"" << path_ << '"';
+}
+
+void QueryCaptureActor::add_query(td::uint64 token_hash, td::BufferSlice query) {
+  if (token_hash == 0) {
+    token_hash = 1;  // zero can't be used as a key
+  }
+  td::int32 bot_index = 0;
+  auto it = bot_indexes_.find(token_hash);
+  if (it != bot_indexes_.end()) {
+    bot_index = it->second;
+  } else if (bot_indexes_.size() < MAX_BOT_COUNT) {
+    bot_index = static_cast<td::int32>(bot_indexes_.size() + 1);
+    bot_indexes_.emplace(token_hash, bot_index);
+  }
+
+  // replace the absolute query start time with the time since the capture start
+  CHECK(query.size() >= sizeof(double));
+  double time;
+  std::memcpy(&time, query.as_slice().data(), sizeof(double));
+  time = td::max(time - start_time_, 0.0);
+  std::memcpy(query.as_mutable_slice().data(), &time, sizeof(double));
+
+  append_binary(td::narrow_cast<td::int32>(sizeof(td::int32) + query.size()));
+  append_binary(bot_index);
+  buffer_.append(query.as_slice().data(), query.size());
+
+  if (buffer_.size() >= MAX_BUFFER_SIZE) {
+    flush();
+  } else if (!has_timeout()) {
+    set_timeout_in(FLUSH_DELAY);
+  }
+}
+
+template <class T>
+void QueryCaptureActor::append_binary(const T &value) {
+  buffer_.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+void QueryCaptureActor::timeout_expired() {
+  flush();
+}
+
+void QueryCaptureActor::tear_down() {
+  if (fd_.empty()) {
+    return;
+  }
+  flush();
+  fd_.close();
+}
+
+void QueryCaptureActor::flush() {
+  cancel_timeout();
+  td::Slice data = buffer_;
+  while (!data.empty()) {
+    auto r_size = fd_.write(data);
+    if (r_size.is_error()) {
+      LOG(ERROR) << "Failed to write to query capture file \"" << path_ << "\": " << r_size.error();
+      break;
+    }
+    data.remove_prefix(r_size.ok());
+  }
+  buffer_.clear();
+}
+
+}  // namespace telegram_bot_api
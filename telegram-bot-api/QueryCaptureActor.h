@@ -0,0 +1,62 @@
+//
+// Copyright Aliaksei Levin (levlam@telegram.org), Arseny Smirnov (arseny30@gmail.com) 2014-2025
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include "telegram-bot-api/Query.h"
+
+#include "td/actor/actor.h"
+
+#include "td/utils/buffer.h"
+#include "td/utils/common.h"
+#include "td/utils/FlatHashMap.h"
+#include "td/utils/port/FileFd.h"
+
+namespace telegram_bot_api {
+
+// Writes anonymized descriptions of incoming queries to a binary file, which can be used to replay the traffic.
+// The file starts with MAGIC and VERSION, followed by records of the form
+// int32 length, int32 bot_index, double time, int32 is_test_dc, string method, int32 argument_count,
+// {string key, int32 value_size}*, int32 file_count, {string field_name, int64 size}*,
+// where strings are stored in TL format and length is the size of the record without the length field.
+// Bot tokens and argument values aren't stored; bots are numbered in the order of their first query,
+// and bots beyond the first MAX_BOT_COUNT ones share bot_index 0.
+class QueryCaptureActor final : public td::Actor {
+ public:
+  static constexpr td::int32 MAGIC = 0x51434254;
+  static constexpr td::int32 VERSION = 1;
+
+  explicit QueryCaptureActor(td::string path) : path_(std::move(path)) {
+  }
+
+  static td::BufferSlice serialize_query(const Query &query);
+
+  void add_query(td::uint64 token_hash, td::BufferSlice query);
+
+ private:
+  static constexpr std::size_t MAX_BUFFER_SIZE = 1 << 16;
+  static constexpr double FLUSH_DELAY = 1.0;
+  static constexpr std::size_t MAX_BOT_COUNT = 100000;
+
+  td::string path_;
+  td::FileFd fd_;
+  td::string buffer_;
+  double start_time_ = 0;
+  td::FlatHashMap<td::uint64, td::int32> bot_indexes_;
+
+  void start_up() final;
+
+  void timeout_expired() final;
+
+  void tear_down() final;
+
+  template <class T>
+  void append_binary(const T &value);
+
+  void flush();
+};
+
+}  // namespace telegram_bot_api
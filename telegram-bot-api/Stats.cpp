@@ -6,12 +6,20 @@
 //
 #include "telegram-bot-api/Stats.h"
 
+#include "telegram-bot-api/ClientParameters.h"
+
 #include "td/utils/common.h"
+#include "td/utils/format.h"
 #include "td/utils/logging.h"
+#include "td/utils/port/config.h"
 #include "td/utils/port/thread.h"
 #include "td/utils/SliceBuilder.h"
 #include "td/utils/StringBuilder.h"
 
+#if TD_PORT_POSIX
+#include <time.h>
+#endif
+
 namespace telegram_bot_api {
 
 ServerCpuStat::ServerCpuStat() {
@@ -83,6 +91,237 @@ td::vector<StatItem> ServerCpuStat::as_vector(double now) {
   return res;
 }
 
+void SchedulerStat::on_event(const Probe &probe) {
+  probe_count_++;
+  total_lag_ += probe.lag_;
+  max_lag_ = td::max(max_lag_, probe.lag_);
+  std::size_t bucket = 0;
+  for (double bound = 0.001; bucket + 1 < LAG_BUCKET_COUNT && probe.lag_ >= bound; bound *= 10) {
+    bucket++;
+  }
+  lag_counts_[bucket]++;
+  if (probe.busy_time_ >= 0) {
+    busy_time_ += probe.busy_time_;
+    duration_ += probe.duration_;
+  }
+}
+
+td::vector<StatItem> SchedulerStat::as_vector() const {
+  td::vector<StatItem> res;
+  if (probe_count_ == 0) {
+    res.push_back({"lag", "UNKNOWN"});
+    res.push_back({"max_lag", "UNKNOWN"});
+    res.push_back({"lag_distribution", "UNKNOWN"});
+  } else {
+    res.push_back({"lag", PSTRING() << td::format::as_time(get_average_lag())});
+    res.push_back({"max_lag", PSTRING() << td::format::as_time(max_lag_)});
+    // percentage of probes with lag <1ms, <10ms, <100ms, <1s and >=1s
+    td::string distribution;
+    for (std::size_t i = 0; i < LAG_BUCKET_COUNT; i++) {
+      if (i != 0) {
+        distribution += '/';
+      }
+      distribution += td::to_string(lag_counts_[i] * 100 / probe_count_);
+    }
+    res.push_back({"lag_distribution", std::move(distribution)});
+  }
+  if (duration_ <= 0) {
+    res.push_back({"busy", "UNKNOWN"});
+  } else {
+    res.push_back({"busy", PSTRING() << (busy_time_ / duration_ * 100) << '%'});
+  }
+  return res;
+}
+
+ServerSchedulerStat::ServerSchedulerStat() {
+  stat_.resize(SharedData::get_thread_count());
+  for (auto &scheduler_stat : stat_) {
+    scheduler_stat.resize(SIZE);
+    for (std::size_t i = 1; i < SIZE; i++) {
+      scheduler_stat[i] = td::TimedStat<SchedulerStat>(DURATIONS[i], td::Time::now());
+    }
+  }
+}
+
+void ServerSchedulerStat::add_probe(td::int32 scheduler_id, const SchedulerStat::Probe &probe, double now) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  CHECK(0 <= scheduler_id && static_cast<std::size_t>(scheduler_id) < stat_.size());
+  for (auto &stat : stat_[scheduler_id]) {
+    stat.add_event(probe, now);
+  }
+}
+
+double ServerSchedulerStat::get_recent_lag(td::int32 scheduler_id, double now) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  CHECK(0 <= scheduler_id && static_cast<std::size_t>(scheduler_id) < stat_.size());
+  return stat_[scheduler_id][1].get_stat(now).get_average_lag();
+}
+
+td::vector<StatItem> ServerSchedulerStat::as_vector(double now) {
+  std::lock_guard<std::mutex> guard(mutex_);
+
+  td::vector<StatItem> res;
+  for (std::size_t scheduler_id = 0; scheduler_id < stat_.size(); scheduler_id++) {
+    auto &scheduler_stat = stat_[scheduler_id];
+    td::vector<StatItem> scheduler_res = scheduler_stat[0].get_stat(now).as_vector();
+    for (std::size_t i = 1; i < SIZE; i++) {
+      auto other = scheduler_stat[i].get_stat(now).as_vector();
+      CHECK(other.size() == scheduler_res.size());
+      for (size_t j = 0; j < scheduler_res.size(); j++) {
+        scheduler_res[j].value_ += "\t";
+        scheduler_res[j].value_ += other[j].value_;
+      }
+    }
+    auto prefix = PSTRING() << "scheduler" << scheduler_id << '_'
+                            << SharedData::get_scheduler_name(static_cast<td::int32>(scheduler_id)) << '_';
+    for (auto &item : scheduler_res) {
+      res.push_back({prefix + item.key_, std::move(item.value_)});
+    }
+  }
+  return res;
+}
+
+double get_thread_cpu_time() {
+#if TD_PORT_POSIX
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+    return static_cast<double>(ts.tv_sec) + static_cast<double>(ts.tv_nsec) * 1e-9;
+  }
+#endif
+  return -1.0;
+}
+
+void SchedulerProbeActor::start_up() {
+  last_probe_time_ = td::Time::now();
+  last_cpu_time_ = get_thread_cpu_time();
+  wakeup_at_ = last_probe_time_ + PROBE_PERIOD;
+  set_timeout_at(wakeup_at_);
+}
+
+void SchedulerProbeActor::timeout_expired() {
+  auto now = td::Time::now();
+  auto cpu_time = get_thread_cpu_time();
+
+  SchedulerStat::Probe probe;
+  probe.lag_ = td::max(now - wakeup_at_, 0.0);
+  probe.busy_time_ = cpu_time >= 0 && last_cpu_time_ >= 0 ? cpu_time - last_cpu_time_ : -1.0;
+  probe.duration_ = now - last_probe_time_;
+  ServerSchedulerStat::instance().add_probe(scheduler_id_, probe, now);
+
+  last_probe_time_ = now;
+  last_cpu_time_ = cpu_time;
+  wakeup_at_ = now + PROBE_PERIOD;
+  set_timeout_at(wakeup_at_);
+}
+
+void QueryTraceBuffer::add_trace(td::string trace) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (traces_.size() < MAX_TRACE_COUNT) {
+    traces_.push_back(std::move(trace));
+    return;
+  }
+  traces_[next_trace_pos_] = std::move(trace);
+  next_trace_pos_ = (next_trace_pos_ + 1) % MAX_TRACE_COUNT;
+}
+
+td::vector<td::string> QueryTraceBuffer::get_traces() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  td::vector<td::string> result;
+  result.reserve(traces_.size());
+  for (std::size_t i = 0; i < traces_.size(); i++) {
+    result.push_back(traces_[(next_trace_pos_ + i) % traces_.size()]);
+  }
+  return result;
+}
+
+void SlowQueryLog::add_slow_query(td::Slice method, td::Slice trace, double now) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto it = slow_query_counts_.find(method.str());
+  if (it == slow_query_counts_.end()) {
+    // method names are chosen by clients, so their number must be limited
+    it = slow_query_counts_.emplace(slow_query_counts_.size() < MAX_METHOD_COUNT ? method.str() : "<other>", 0).first;
+  }
+  it->second++;
+
+  if (now >= log_period_start_time_ + 1.0) {
+    if (skipped_query_count_ > 0) {
+      LOG(WARNING) << "Skipped " << skipped_query_count_ << " slow queries";
+      skipped_query_count_ = 0;
+    }
+    log_period_start_time_ = now;
+    logged_query_count_ = 0;
+  }
+  if (logged_query_count_ >= MAX_LOGGED_QUERIES_PER_SECOND) {
+    skipped_query_count_++;
+    return;
+  }
+  logged_query_count_++;
+  LOG(WARNING) << "Slow query " << trace;
+}
+
+td::vector<StatItem> SlowQueryLog::as_vector() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  td::vector<StatItem> res;
+  res.reserve(slow_query_counts_.size());
+  for (auto &it : slow_query_counts_) {
+    res.push_back({PSTRING() << "slow_query_count_" << it.first, td::to_string(it.second)});
+  }
+  return res;
+}
+
+void SerializationStat::add_update(td::Slice update_type, double cpu_time, std::size_t size) {
+  add("update_", update_type, cpu_time, size);
+}
+
+void SerializationStat::add_answer(td::Slice method, double cpu_time, std::size_t size) {
+  add("method_", method, cpu_time, size);
+}
+
+void SerializationStat::add_parsing(td::Slice argument_name, double cpu_time, std::size_t size) {
+  add("parsing_", argument_name, cpu_time, size);
+}
+
+void SerializationStat::add(td::Slice prefix, td::Slice name, double cpu_time, std::size_t size) {
+  auto key = PSTRING() << prefix << name;
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto &item = items_[key];
+  item.count_++;
+  item.cpu_time_ += cpu_time;
+  item.size_ += static_cast<td::int64>(size);
+}
+
+td::vector<StatItem> SerializationStat::as_vector() {
+  std::lock_guard<std::mutex> guard(mutex_);
+  td::vector<StatItem> res;
+  res.reserve(items_.size());
+  for (auto &it : items_) {
+    const auto &item = it.second;
+    auto count = static_cast<double>(item.count_);
+    res.push_back({PSTRING() << "serialization_" << it.first,
+                   PSTRING() << item.count_ << '\t' << item.cpu_time_ / count * 1e9 << "ns\t"
+                             << static_cast<double>(item.size_) / count << 'B'});
+  }
+  return res;
+}
+
+td::vector<StatItem> ServerBotMemoryUsage::as_vector() const {
+  td::vector<StatItem> res;
+  auto add_item = [&res](td::string name, std::size_t value) {
+    res.push_back({std::move(name), PSTRING() << td::format::as_size(value)});
+  };
+  add_item("memory_total", get_total());
+  add_item("memory_message_cache", message_cache_bytes_);
+  add_item("memory_user_cache", user_cache_bytes_);
+  add_item("memory_chat_cache", chat_cache_bytes_);
+  add_item("memory_supergroup_cache", supergroup_cache_bytes_);
+  add_item("memory_json_cache", json_cache_bytes_);
+  add_item("memory_reply_markup_cache", reply_markup_cache_bytes_);
+  add_item("memory_pending_updates", pending_update_bytes_);
+  add_item("memory_webhook_updates", webhook_update_bytes_);
+  add_item("memory_file_uploads", file_upload_bytes_);
+  return res;
+}
+
 void ServerBotStat::normalize(double duration) {
   if (duration == 0) {
     return;
@@ -96,6 +335,17 @@ void ServerBotStat::normalize(double duration) {
   response_count_error_ /= duration;
   response_bytes_ /= duration;
   update_count_ /= duration;
+  cpu_time_ /= duration;
+  serialization_cpu_time_ /= duration;
+  webhook_update_count_ /= duration;
+  webhook_delivery_time_ /= duration;
+  for (auto &count : webhook_latency_counts_) {
+    count /= duration;
+  }
+  webhook_sent_bytes_ /= duration;
+  for (auto &count : webhook_retry_counts_) {
+    count /= duration;
+  }
 }
 
 void ServerBotStat::add(const ServerBotStat &stat) {
@@ -111,6 +361,69 @@ void ServerBotStat::add(const ServerBotStat &stat) {
   response_bytes_ += stat.response_bytes_;
 
   update_count_ += stat.update_count_;
+
+  cpu_time_ += stat.cpu_time_;
+  serialization_cpu_time_ += stat.serialization_cpu_time_;
+
+  webhook_update_count_ += stat.webhook_update_count_;
+  webhook_delivery_time_ += stat.webhook_delivery_time_;
+  for (std::size_t i = 0; i < WEBHOOK_LATENCY_BUCKET_COUNT; i++) {
+    webhook_latency_counts_[i] += stat.webhook_latency_counts_[i];
+  }
+  webhook_sent_bytes_ += stat.webhook_sent_bytes_;
+  for (std::size_t i = 0; i < static_cast<std::size_t>(WebhookRetryCause::Size); i++) {
+    webhook_retry_counts_[i] += stat.webhook_retry_counts_[i];
+  }
+}
+
+std::size_t ServerBotStat::get_webhook_latency_bucket(double delivery_time) {
+  if (delivery_time < 0.1) {
+    return 0;
+  }
+  if (delivery_time < 0.5) {
+    return 1;
+  }
+  if (delivery_time < 2.0) {
+    return 2;
+  }
+  if (delivery_time < 10.0) {
+    return 3;
+  }
+  return 4;
+}
+
+const char *ServerBotStat::get_webhook_latency_bucket_name(std::size_t bucket) {
+  switch (bucket) {
+    case 0:
+      return "webhook_delivered_in_100ms";
+    case 1:
+      return "webhook_delivered_in_500ms";
+    case 2:
+      return "webhook_delivered_in_2s";
+    case 3:
+      return "webhook_delivered_in_10s";
+    case 4:
+      return "webhook_delivered_slower";
+    default:
+      UNREACHABLE();
+      return "";
+  }
+}
+
+const char *ServerBotStat::get_webhook_retry_cause_name(std::size_t cause) {
+  switch (static_cast<WebhookRetryCause>(cause)) {
+    case WebhookRetryCause::HttpError:
+      return "http_error";
+    case WebhookRetryCause::TooManyRequests:
+      return "too_many_requests";
+    case WebhookRetryCause::WrongResponse:
+      return "wrong_response";
+    case WebhookRetryCause::ConnectionClosed:
+      return "connection_closed";
+    default:
+      UNREACHABLE();
+      return "";
+  }
 }
 
 td::vector<StatItem> ServerBotStat::as_vector() const {
@@ -128,6 +441,18 @@ td::vector<StatItem> ServerBotStat::as_vector() const {
   add_item("response_count_error", response_count_error_);
   add_item("response_bytes", response_bytes_);
   add_item("update_count", update_count_);
+  add_item("cpu_time", cpu_time_);
+  add_item("serialization_cpu_time", serialization_cpu_time_);
+  add_item("webhook_update_count", webhook_update_count_);
+  add_item("webhook_average_delivery_time",
+           webhook_update_count_ == 0 ? 0.0 : webhook_delivery_time_ / webhook_update_count_);
+  for (std::size_t i = 0; i < WEBHOOK_LATENCY_BUCKET_COUNT; i++) {
+    add_item(get_webhook_latency_bucket_name(i), webhook_latency_counts_[i]);
+  }
+  add_item("webhook_sent_bytes", webhook_sent_bytes_);
+  for (std::size_t i = 0; i < static_cast<std::size_t>(WebhookRetryCause::Size); i++) {
+    add_item(PSTRING() << "webhook_retry_" << get_webhook_retry_cause_name(i), webhook_retry_counts_[i]);
+  }
   return res;
 }
 
@@ -173,6 +498,20 @@ double BotStatActor::get_score(double now) {
   return minute_score + all_time_score + active_request_score + active_file_upload_score;
 }
 
+double BotStatActor::get_cpu_score(double now) {
+  auto minute_stat = stat_[2].stat_duration(now);
+  double minute_score = minute_stat.first.cpu_time_;
+  if (minute_stat.second != 0) {
+    minute_score /= minute_stat.second;
+  }
+  auto all_time_stat = stat_[0].stat_duration(now);
+  double all_time_score = 0.01 * all_time_stat.first.cpu_time_;
+  if (all_time_stat.second != 0) {
+    all_time_score /= all_time_stat.second;
+  }
+  return minute_score + all_time_score;
+}
+
 double BotStatActor::get_minute_update_count(double now) {
   auto minute_stat = stat_[2].stat_duration(now);
   double result = minute_stat.first.update_count_;
@@ -182,6 +521,12 @@ double BotStatActor::get_minute_update_count(double now) {
   return result;
 }
 
+ServerBotStat BotStatActor::get_minute_stat(double now) {
+  auto minute_stat = stat_[2].stat_duration(now);
+  minute_stat.first.normalize(minute_stat.second);
+  return minute_stat.first;
+}
+
 td::int64 BotStatActor::get_active_request_count() const {
   return active_request_count_;
 }
@@ -10,9 +10,11 @@
 
 #include "td/utils/common.h"
 #include "td/utils/port/Stat.h"
+#include "td/utils/Slice.h"
 #include "td/utils/Time.h"
 #include "td/utils/TimedStat.h"
 
+#include <map>
 #include <mutex>
 
 namespace telegram_bot_api {
@@ -22,6 +24,9 @@ struct StatItem {
   td::string value_;
 };
 
+// returns CPU time consumed by the current thread in seconds or a negative value if it is unknown
+double get_thread_cpu_time();
+
 class CpuStat {
  public:
   void on_event(const td::CpuStat &event) {
@@ -66,6 +71,153 @@ class ServerCpuStat {
   ServerCpuStat();
 };
 
+class SchedulerStat {
+ public:
+  struct Probe {
+    double lag_;
+    double busy_time_;  // negative if unknown
+    double duration_;
+  };
+  void on_event(const Probe &probe);
+
+  td::vector<StatItem> as_vector() const;
+
+  double get_average_lag() const {
+    return probe_count_ == 0 ? 0.0 : total_lag_ / static_cast<double>(probe_count_);
+  }
+
+ private:
+  static constexpr std::size_t LAG_BUCKET_COUNT = 5;
+
+  td::int64 probe_count_ = 0;
+  double total_lag_ = 0;
+  double max_lag_ = 0;
+  td::int64 lag_counts_[LAG_BUCKET_COUNT] = {};
+  double busy_time_ = 0;
+  double duration_ = 0;
+};
+
+class ServerSchedulerStat {
+ public:
+  static ServerSchedulerStat &instance() {
+    static ServerSchedulerStat stat;
+    return stat;
+  }
+
+  void add_probe(td::int32 scheduler_id, const SchedulerStat::Probe &probe, double now);
+
+  // average lag of the scheduler during the last few seconds
+  double get_recent_lag(td::int32 scheduler_id, double now);
+
+  td::vector<StatItem> as_vector(double now);
+
+ private:
+  static constexpr std::size_t SIZE = 4;
+  static constexpr td::int32 DURATIONS[SIZE] = {0, 5, 60, 60 * 60};
+
+  std::mutex mutex_;
+  td::vector<td::vector<td::TimedStat<SchedulerStat>>> stat_;
+
+  ServerSchedulerStat();
+};
+
+// periodically measures event loop lag and busy time of the scheduler on which it is created
+class SchedulerProbeActor final : public td::Actor {
+ public:
+  explicit SchedulerProbeActor(td::int32 scheduler_id) : scheduler_id_(scheduler_id) {
+  }
+
+ private:
+  static constexpr double PROBE_PERIOD = 0.05;
+
+  td::int32 scheduler_id_;
+  double wakeup_at_ = 0;
+  double last_probe_time_ = 0;
+  double last_cpu_time_ = -1.0;
+
+  void start_up() final;
+
+  void timeout_expired() final;
+};
+
+class QueryTraceBuffer {
+ public:
+  static QueryTraceBuffer &instance() {
+    static QueryTraceBuffer buffer;
+    return buffer;
+  }
+
+  void add_trace(td::string trace);
+
+  td::vector<td::string> get_traces();
+
+ private:
+  static constexpr std::size_t MAX_TRACE_COUNT = 100;
+
+  std::mutex mutex_;
+  td::vector<td::string> traces_;
+  std::size_t next_trace_pos_ = 0;
+
+  QueryTraceBuffer() = default;
+};
+
+// counts slow queries by method and writes them to the log with a limited rate
+class SlowQueryLog {
+ public:
+  static SlowQueryLog &instance() {
+    static SlowQueryLog log;
+    return log;
+  }
+
+  void add_slow_query(td::Slice method, td::Slice trace, double now);
+
+  td::vector<StatItem> as_vector();
+
+ private:
+  static constexpr std::size_t MAX_METHOD_COUNT = 1000;
+  static constexpr td::int32 MAX_LOGGED_QUERIES_PER_SECOND = 10;
+
+  std::mutex mutex_;
+  std::map<td::string, td::int64> slow_query_counts_;
+  double log_period_start_time_ = 0;
+  td::int32 logged_query_count_ = 0;
+  td::int64 skipped_query_count_ = 0;
+
+  SlowQueryLog() = default;
+};
+
+// accumulates CPU time and size of JSON serialization by update type and by method
+// and of JSON parsing by request argument; collected only if CPU time statistics are enabled
+class SerializationStat {
+ public:
+  static SerializationStat &instance() {
+    static SerializationStat stat;
+    return stat;
+  }
+
+  void add_update(td::Slice update_type, double cpu_time, std::size_t size);
+
+  void add_answer(td::Slice method, double cpu_time, std::size_t size);
+
+  void add_parsing(td::Slice argument_name, double cpu_time, std::size_t size);
+
+  td::vector<StatItem> as_vector();
+
+ private:
+  struct Item {
+    td::int64 count_ = 0;
+    double cpu_time_ = 0;
+    td::int64 size_ = 0;
+  };
+
+  std::mutex mutex_;
+  std::map<td::string, Item> items_;
+
+  void add(td::Slice prefix, td::Slice name, double cpu_time, std::size_t size);
+
+  SerializationStat() = default;
+};
+
 class ServerBotInfo {
  public:
   td::string id_;
@@ -78,6 +230,28 @@ class ServerBotInfo {
   td::int32 webhook_max_connections_ = 0;
   std::size_t pending_update_count_ = 0;
   double start_time_ = 0;
+  td::int64 reply_markup_cache_hit_count_ = 0;
+  td::int64 reply_markup_cache_miss_count_ = 0;
+};
+
+// approximate memory used by a bot
+struct ServerBotMemoryUsage {
+  std::size_t message_cache_bytes_ = 0;
+  std::size_t user_cache_bytes_ = 0;
+  std::size_t chat_cache_bytes_ = 0;
+  std::size_t supergroup_cache_bytes_ = 0;
+  std::size_t json_cache_bytes_ = 0;
+  std::size_t reply_markup_cache_bytes_ = 0;
+  std::size_t pending_update_bytes_ = 0;
+  std::size_t webhook_update_bytes_ = 0;
+  std::size_t file_upload_bytes_ = 0;
+
+  std::size_t get_total() const {
+    return message_cache_bytes_ + user_cache_bytes_ + chat_cache_bytes_ + supergroup_cache_bytes_ + json_cache_bytes_ +
+           reply_markup_cache_bytes_ + pending_update_bytes_ + webhook_update_bytes_ + file_upload_bytes_;
+  }
+
+  td::vector<StatItem> as_vector() const;
 };
 
 struct ServerBotStat {
@@ -94,6 +268,18 @@ struct ServerBotStat {
 
   double update_count_ = 0;
 
+  double cpu_time_ = 0;
+  double serialization_cpu_time_ = 0;
+
+  static constexpr std::size_t WEBHOOK_LATENCY_BUCKET_COUNT = 5;
+  double webhook_update_count_ = 0;
+  double webhook_delivery_time_ = 0;
+  double webhook_latency_counts_[WEBHOOK_LATENCY_BUCKET_COUNT] = {};
+  double webhook_sent_bytes_ = 0;
+
+  enum class WebhookRetryCause : td::int32 { HttpError, TooManyRequests, WrongResponse, ConnectionClosed, Size };
+  double webhook_retry_counts_[static_cast<std::size_t>(WebhookRetryCause::Size)] = {};
+
   void normalize(double duration);
 
   void add(const ServerBotStat &stat);
@@ -108,6 +294,7 @@ struct ServerBotStat {
     size_t size_;
     td::int64 file_count_;
     td::int64 files_size_;
+    double serialization_cpu_time_;
   };
   void on_event(const Response &response) {
     response_count_++;
@@ -117,6 +304,16 @@ struct ServerBotStat {
       response_count_error_++;
     }
     response_bytes_ += static_cast<double>(response.size_);
+    serialization_cpu_time_ += response.serialization_cpu_time_;
+  }
+
+  struct CpuTime {
+    double cpu_time_;                // spent in handlers of the bot, including serialization
+    double serialization_cpu_time_;  // spent in serialization of updates
+  };
+  void on_event(const CpuTime &cpu_time) {
+    cpu_time_ += cpu_time.cpu_time_;
+    serialization_cpu_time_ += cpu_time.serialization_cpu_time_;
   }
 
   struct Request {
@@ -133,6 +330,57 @@ struct ServerBotStat {
     request_files_max_bytes_ = td::max(request_files_max_bytes_, request.files_max_size_);
   }
 
+  struct WebhookSend {
+    std::size_t size_;
+  };
+  void on_event(const WebhookSend &send) {
+    webhook_sent_bytes_ += static_cast<double>(send.size_);
+  }
+
+  struct WebhookDelivery {
+    double delivery_time_;
+  };
+  void on_event(const WebhookDelivery &delivery) {
+    webhook_update_count_++;
+    webhook_delivery_time_ += delivery.delivery_time_;
+    webhook_latency_counts_[get_webhook_latency_bucket(delivery.delivery_time_)]++;
+  }
+
+  struct WebhookRetry {
+    WebhookRetryCause cause_;
+  };
+  void on_event(const WebhookRetry &retry) {
+    webhook_retry_counts_[static_cast<std::size_t>(retry.cause_)]++;
+  }
+
+  // current state of the webhook; isn't accumulated
+  struct WebhookState {
+    td::int32 connection_count_ = 0;
+    td::int32 idle_connection_count_ = 0;
+    td::int32 connecting_count_ = 0;
+    td::int32 in_flight_update_count_ = 0;
+    td::int32 loaded_update_count_ = 0;
+    td::int64 loaded_update_bytes_ = 0;
+    double oldest_update_load_time_ = 0;  // 0 if there are no loaded updates
+
+    bool operator==(const WebhookState &other) const {
+      return connection_count_ == other.connection_count_ && idle_connection_count_ == other.idle_connection_count_ &&
+             connecting_count_ == other.connecting_count_ &&
+             in_flight_update_count_ == other.in_flight_update_count_ &&
+             loaded_update_count_ == other.loaded_update_count_ &&
+             loaded_update_bytes_ == other.loaded_update_bytes_ &&
+             oldest_update_load_time_ == other.oldest_update_load_time_;
+    }
+  };
+  void on_event(const WebhookState &state) {
+  }
+
+  static std::size_t get_webhook_latency_bucket(double delivery_time);
+
+  static const char *get_webhook_latency_bucket_name(std::size_t bucket);
+
+  static const char *get_webhook_retry_cause_name(std::size_t cause);
+
   td::vector<StatItem> as_vector() const;
 };
 
@@ -156,13 +404,16 @@ class BotStatActor final : public td::Actor {
     this->Actor::operator=(std::move(other));
     std::move(other.stat_, other.stat_ + SIZE, stat_);
     parent_ = other.parent_;
+    webhook_state_ = other.webhook_state_;
     return *this;
   }
   ~BotStatActor() final = default;
 
   template <class EventT>
   void add_event(const EventT &event, double now) {
-    last_activity_timestamp_ = now;
+    if (is_activity_event(event)) {
+      last_activity_timestamp_ = now;
+    }
     for (auto &stat : stat_) {
       stat.add_event(event, now);
     }
@@ -178,8 +429,16 @@ class BotStatActor final : public td::Actor {
 
   double get_score(double now);
 
+  double get_cpu_score(double now);
+
   double get_minute_update_count(double now);
 
+  ServerBotStat get_minute_stat(double now);
+
+  const ServerBotStat::WebhookState &get_webhook_state() const {
+    return webhook_state_;
+  }
+
   td::int64 get_active_request_count() const;
 
   td::int64 get_active_file_upload_bytes() const;
@@ -199,10 +458,44 @@ class BotStatActor final : public td::Actor {
   td::int64 active_request_count_ = 0;
   td::int64 active_file_upload_bytes_ = 0;
   td::int64 active_file_upload_count_ = 0;
+  ServerBotStat::WebhookState webhook_state_;
+
+  // internal events don't make the bot active
+  template <class EventT>
+  static bool is_activity_event(const EventT &event) {
+    return true;
+  }
+
+  static bool is_activity_event(const ServerBotStat::CpuTime &event) {
+    return false;
+  }
+
+  static bool is_activity_event(const ServerBotStat::WebhookState &event) {
+    return false;
+  }
 
   void on_event(const ServerBotStat::Update &update) {
   }
 
+  void on_event(const ServerBotStat::CpuTime &cpu_time) {
+  }
+
+  void on_event(const ServerBotStat::WebhookSend &send) {
+  }
+
+  void on_event(const ServerBotStat::WebhookDelivery &delivery) {
+  }
+
+  void on_event(const ServerBotStat::WebhookRetry &retry) {
+  }
+
+  void on_event(const ServerBotStat::WebhookState &state) {
+    if (!parent_.empty()) {
+      // the state makes sense only for a single bot
+      webhook_state_ = state;
+    }
+  }
+
   void on_event(const ServerBotStat::Response &response) {
     active_request_count_--;
     active_file_upload_count_ -= response.file_count_;
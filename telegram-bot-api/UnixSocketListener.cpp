@@ -0,0 +1,181 @@
+//
+// Copyright Aliaksei Levin (levlam@telegram.org), Arseny Smirnov (arseny30@gmail.com) 2014-2025
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#include "telegram-bot-api/UnixSocketListener.h"
+
+#include "td/utils/logging.h"
+#include "td/utils/port/detail/NativeFd.h"
+#include "td/utils/port/detail/PollableFd.h"
+#include "td/utils/port/PollFlags.h"
+#include "td/utils/Slice.h"
+#include "td/utils/SliceBuilder.h"
+#include "td/utils/Status.h"
+
+#if TD_PORT_POSIX
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace telegram_bot_api {
+
+#if TD_PORT_POSIX
+static int create_unix_socket() {
+#ifdef SOCK_CLOEXEC
+  return ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+#else
+  auto fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd != -1) {
+    ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+  return fd;
+#endif
+}
+
+static int accept_unix_socket(int server_fd) {
+#ifdef SOCK_CLOEXEC
+  return ::accept4(server_fd, nullptr, nullptr, SOCK_CLOEXEC);
+#else
+  auto fd = ::accept(server_fd, nullptr, nullptr);
+  if (fd != -1) {
+    ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+  return fd;
+#endif
+}
+
+static td::Result<td::SocketFd> open_unix_server_socket(td::CSlice path) {
+  sockaddr_un address;
+  std::memset(&address, 0, sizeof(address));
+  if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+    return td::Status::Error(PSLICE() << "Invalid Unix socket path \"" << path << '"');
+  }
+  address.sun_family = AF_UNIX;
+  std::memcpy(address.sun_path, path.c_str(), path.size());
+
+  td::NativeFd fd(create_unix_socket());
+  if (!fd) {
+    return OS_SOCKET_ERROR("Failed to create a Unix socket");
+  }
+
+  // a socket file can be left by a previous instance of the server; it is removed only if nobody listens on it
+  if (::connect(fd.socket(), reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == 0) {
+    return td::Status::Error(PSLICE() << "Unix socket \"" << path << "\" is already in use");
+  }
+  auto connect_errno = errno;
+  if (connect_errno == ECONNREFUSED) {
+    struct stat buf;
+    if (::lstat(path.c_str(), &buf) == 0 && S_ISSOCK(buf.st_mode)) {
+      ::unlink(path.c_str());
+    }
+  } else if (connect_errno != ENOENT) {
+    return td::Status::PosixError(connect_errno, PSLICE() << "Failed to check Unix socket \"" << path << '"');
+  }
+
+  // the socket can't be reused after a failed connect
+  fd = td::NativeFd(create_unix_socket());
+  if (!fd) {
+    return OS_SOCKET_ERROR("Failed to create a Unix socket");
+  }
+  if (::bind(fd.socket(), reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == -1) {
+    return OS_SOCKET_ERROR(PSLICE() << "Failed to bind to \"" << path << '"');
+  }
+  if (::listen(fd.socket(), 8192) == -1) {
+    return OS_SOCKET_ERROR(PSLICE() << "Failed to listen on \"" << path << '"');
+  }
+  return td::SocketFd::from_native_fd(std::move(fd));
+}
+#endif
+
+bool UnixSocketListener::is_supported() {
+#if TD_PORT_POSIX
+  return true;
+#else
+  return false;
+#endif
+}
+
+td::string UnixSocketListener::get_peer_name(const td::SocketFd &socket_fd) {
+#if TD_LINUX
+  struct ucred credentials;
+  socklen_t credentials_size = sizeof(credentials);
+  if (::getsockopt(socket_fd.get_native_fd().socket(), SOL_SOCKET, SO_PEERCRED, &credentials, &credentials_size) ==
+      0) {
+    return PSTRING() << "unix:" << credentials.uid;
+  }
+#elif TD_DARWIN || TD_FREEBSD || TD_OPENBSD || TD_NETBSD
+  uid_t user_id;
+  gid_t group_id;
+  if (::getpeereid(socket_fd.get_native_fd().socket(), &user_id, &group_id) == 0) {
+    return PSTRING() << "unix:" << user_id;
+  }
+#endif
+  // all peers with unknown credentials share the same flood control
+  return "unix:unknown";
+}
+
+void UnixSocketListener::start_up() {
+#if TD_PORT_POSIX
+  auto r_server_fd = open_unix_server_socket(path_);
+  if (r_server_fd.is_error()) {
+    LOG(ERROR) << r_server_fd.error();
+    return stop();
+  }
+  server_fd_ = r_server_fd.move_as_ok();
+  td::Scheduler::subscribe(server_fd_.get_poll_info().extract_pollable_fd(this), td::PollFlags::Read());
+#else
+  LOG(ERROR) << "Unix domain sockets aren't supported";
+  stop();
+#endif
+}
+
+void UnixSocketListener::tear_down() {
+  if (!server_fd_.empty()) {
+    td::Scheduler::unsubscribe_before_close(server_fd_.get_poll_info().get_pollable_fd_ref());
+    server_fd_.close();
+#if TD_PORT_POSIX
+    ::unlink(path_.c_str());
+#endif
+  }
+}
+
+void UnixSocketListener::loop() {
+#if TD_PORT_POSIX
+  if (server_fd_.empty()) {
+    return stop();
+  }
+  td::sync_with_poll(server_fd_);
+  while (td::can_read_local(server_fd_)) {
+    auto native_fd = accept_unix_socket(server_fd_.get_native_fd().socket());
+    if (native_fd == -1) {
+      auto accept_errno = errno;
+      if (accept_errno == EINTR || accept_errno == ECONNABORTED) {
+        continue;
+      }
+      if (accept_errno != EAGAIN && accept_errno != EWOULDBLOCK) {
+        LOG(ERROR) << td::Status::PosixError(accept_errno, "Failed to accept a Unix socket connection");
+      }
+      server_fd_.get_poll_info().clear_flags(td::PollFlags::Read());
+      break;
+    }
+    auto r_socket_fd = td::SocketFd::from_native_fd(td::NativeFd(native_fd));
+    if (r_socket_fd.is_error()) {
+      LOG(ERROR) << r_socket_fd.error();
+      continue;
+    }
+    send_closure(callback_, &td::TcpListener::Callback::accept, r_socket_fd.move_as_ok());
+  }
+  if (td::can_close_local(server_fd_)) {
+    stop();
+  }
+#endif
+}
+
+}  // namespace telegram_bot_api
@@ -0,0 +1,43 @@
+//
+// Copyright Aliaksei Levin (levlam@telegram.org), Arseny Smirnov (arseny30@gmail.com) 2014-2025
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+#pragma once
+
+#include "td/net/TcpListener.h"
+
+#include "td/actor/actor.h"
+
+#include "td/utils/common.h"
+#include "td/utils/port/SocketFd.h"
+
+namespace telegram_bot_api {
+
+// Accepts stream connections on a Unix domain socket and passes them to a TcpListener::Callback,
+// so they can be handled in the same way as TCP connections
+class UnixSocketListener final : public td::Actor {
+ public:
+  UnixSocketListener(td::string path, td::ActorShared<td::TcpListener::Callback> callback)
+      : path_(std::move(path)), callback_(std::move(callback)) {
+  }
+
+  static bool is_supported();
+
+  // returns "unix:<user identifier>" of the process connected to the socket
+  static td::string get_peer_name(const td::SocketFd &socket_fd);
+
+ private:
+  td::string path_;
+  td::ActorShared<td::TcpListener::Callback> callback_;
+  td::SocketFd server_fd_;
+
+  void start_up() final;
+
+  void tear_down() final;
+
+  void loop() final;
+};
+
+}  // namespace telegram_bot_api
@@ -38,12 +38,13 @@ std::atomic<td::uint64> WebhookActor::total_connection_count_{0};
 WebhookActor::WebhookActor(td::ActorShared<Callback> callback, td::int64 tqueue_id, td::HttpUrl url,
                            td::string cert_path, td::int32 max_connections, bool from_db_flag,
                            td::string cached_ip_address, bool fix_ip_address, td::string secret_token,
-                           std::shared_ptr<const ClientParameters> parameters)
+                           std::shared_ptr<const ClientParameters> parameters, td::ActorId<BotStatActor> stat_actor)
     : callback_(std::move(callback))
     , tqueue_id_(tqueue_id)
     , url_(std::move(url))
     , cert_path_(std::move(cert_path))
     , parameters_(std::move(parameters))
+    , stat_actor_(stat_actor)
     , fix_ip_address_(fix_ip_address)
     , from_db_flag_(from_db_flag)
     , max_connections_(max_connections)
@@ -341,6 +342,7 @@ void WebhookActor::loop() {
     if (wakeup_at_ != 0) {
       set_timeout_at(wakeup_at_);
     }
+    update_webhook_state();
   }
   if (stop_flag_) {
     VLOG(webhook) << "Stop";
@@ -406,11 +408,14 @@ void WebhookActor::load_updates() {
     dest.id_ = update.id;
     dest.json_ = update.data.str();
     dest.delay_ = 1;
+    dest.load_time_ = now;
     dest.wakeup_at_ = now;
     CHECK(update.expires_at >= unix_time_now);
     dest.expires_at_ = update.expires_at;
     dest.queue_id_ = update.extra;
     tqueue_offset_ = update.id.next().move_as_ok();
+    loaded_update_bytes_ += static_cast<td::int64>(sizeof(Update) + dest.json_.size());
+    update_load_times_.emplace(dest.load_time_, dest.id_.value());
 
     if (dest.queue_id_ == 0) {
       dest.queue_id_ = unique_queue_id_++;
@@ -457,6 +462,8 @@ void WebhookActor::drop_event(td::TQueue::EventId event_id) {
   auto it = update_map_.find(event_id);
   CHECK(it != update_map_.end());
   auto queue_id = it->second->queue_id_;
+  loaded_update_bytes_ -= static_cast<td::int64>(sizeof(Update) + it->second->json_.size());
+  update_load_times_.erase({it->second->load_time_, event_id.value()});
   update_map_.erase(it);
 
   auto queue_updates_it = queue_updates_.find(queue_id);
@@ -485,13 +492,16 @@ void WebhookActor::on_update_ok(td::TQueue::EventId event_id) {
 
   VLOG(webhook) << "Receive ok for update " << event_id << " in " << (last_success_time_ - it->second->last_send_time_)
                 << " seconds";
+  send_stat_event(ServerBotStat::WebhookDelivery{last_success_time_ - it->second->last_send_time_});
 
   drop_event(event_id);
 }
 
-void WebhookActor::on_update_error(td::TQueue::EventId event_id, td::Slice error, int retry_after) {
+void WebhookActor::on_update_error(td::TQueue::EventId event_id, td::Slice error, int retry_after,
+                                   ServerBotStat::WebhookRetryCause cause) {
   last_update_was_successful_ = false;
   double now = td::Time::now();
+  send_stat_event(ServerBotStat::WebhookRetry{cause});
 
   auto it = update_map_.find(event_id);
   CHECK(it != update_map_.end());
@@ -575,6 +585,8 @@ td::Status WebhookActor::send_update() {
 
   auto &connection = *Connection::from_list_node(ready_connections_.get());
   connection.event_id_ = update.id_;
+  in_flight_update_count_++;
+  send_stat_event(ServerBotStat::WebhookSend{r_header.ok().size() + body.size()});
 
   VLOG(webhook) << "Send update " << update.id_ << " from queue " << queue_id << " into connection " << connection.id_
                 << ": " << update.json_;
@@ -586,6 +598,32 @@ td::Status WebhookActor::send_update() {
   return td::Status::OK();
 }
 
+template <class EventT>
+void WebhookActor::send_stat_event(const EventT &event) {
+  if (stat_actor_.empty()) {
+    return;
+  }
+  send_closure(stat_actor_, &BotStatActor::add_event<EventT>, event, td::Time::now());
+}
+
+void WebhookActor::update_webhook_state() {
+  ServerBotStat::WebhookState state;
+  state.connection_count_ = static_cast<td::int32>(connections_.size());
+  state.in_flight_update_count_ = in_flight_update_count_;
+  state.idle_connection_count_ = state.connection_count_ - in_flight_update_count_;
+  state.connecting_count_ = static_cast<td::int32>(pending_sockets_.size() + ready_sockets_.size());
+  state.loaded_update_count_ = static_cast<td::int32>(update_map_.size());
+  state.loaded_update_bytes_ = loaded_update_bytes_;
+  if (!update_load_times_.empty()) {
+    state.oldest_update_load_time_ = update_load_times_.begin()->first;
+  }
+  if (state == last_webhook_state_) {
+    return;
+  }
+  last_webhook_state_ = state;
+  send_stat_event(state);
+}
+
 void WebhookActor::send_updates() {
   VLOG(webhook) << "Have " << (queues_.size() + update_map_.size() - queue_updates_.size()) << " pending updates in "
                 << queues_.size() << " queues to send";
@@ -612,6 +650,7 @@ void WebhookActor::handle(td::unique_ptr<td::HttpQuery> response) {
   bool close_connection = false;
   td::string query_error;
   td::int32 retry_after = 0;
+  auto retry_cause = ServerBotStat::WebhookRetryCause::WrongResponse;
   bool need_close = false;
 
   if (response) {
@@ -651,6 +690,11 @@ void WebhookActor::handle(td::unique_ptr<td::HttpQuery> response) {
           first_error_410_time_ = 0;
         }
         retry_after = response->get_retry_after();
+        if (response->code_ == 429 || retry_after > 0) {
+          retry_cause = ServerBotStat::WebhookRetryCause::TooManyRequests;
+        } else {
+          retry_cause = ServerBotStat::WebhookRetryCause::HttpError;
+        }
         // LOG(WARNING) << query_error;
         on_webhook_error(query_error);
       }
@@ -661,16 +705,19 @@ void WebhookActor::handle(td::unique_ptr<td::HttpQuery> response) {
     VLOG(webhook) << *response;
   } else {
     query_error = "Webhook connection closed";
+    retry_cause = ServerBotStat::WebhookRetryCause::ConnectionClosed;
     connection_ptr->actor_id_.release();
     close_connection = true;
   }
 
   auto event_id = connection_ptr->event_id_;
   if (!event_id.empty()) {
+    CHECK(in_flight_update_count_ > 0);
+    in_flight_update_count_--;
     if (query_error.empty()) {
       on_update_ok(event_id);
     } else {
-      on_update_error(event_id, query_error, retry_after);
+      on_update_error(event_id, query_error, retry_after, retry_cause);
     }
   } else {
     CHECK(!query_error.empty());
@@ -763,6 +810,9 @@ void WebhookActor::close() {
 
 void WebhookActor::tear_down() {
   total_connection_count_.fetch_sub(connections_.size(), std::memory_order_relaxed);
+  if (!(last_webhook_state_ == ServerBotStat::WebhookState())) {
+    send_stat_event(ServerBotStat::WebhookState());
+  }
 }
 
 void WebhookActor::on_webhook_verified() {
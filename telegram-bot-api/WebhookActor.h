@@ -7,6 +7,7 @@
 #pragma once
 
 #include "telegram-bot-api/Query.h"
+#include "telegram-bot-api/Stats.h"
 
 #include "td/db/TQueue.h"
 
@@ -36,6 +37,7 @@
 #include <memory>
 #include <set>
 #include <tuple>
+#include <utility>
 
 namespace telegram_bot_api {
 
@@ -54,7 +56,8 @@ class WebhookActor final : public td::HttpOutboundConnection::Callback {
 
   WebhookActor(td::ActorShared<Callback> callback, td::int64 tqueue_id, td::HttpUrl url, td::string cert_path,
                td::int32 max_connections, bool from_db_flag, td::string cached_ip_address, bool fix_ip_address,
-               td::string secret_token, std::shared_ptr<const ClientParameters> parameters);
+               td::string secret_token, std::shared_ptr<const ClientParameters> parameters,
+               td::ActorId<BotStatActor> stat_actor);
   WebhookActor(const WebhookActor &) = delete;
   WebhookActor &operator=(const WebhookActor &) = delete;
   WebhookActor(WebhookActor &&) = delete;
@@ -84,6 +87,8 @@ class WebhookActor final : public td::HttpOutboundConnection::Callback {
   td::HttpUrl url_;
   const td::string cert_path_;
   std::shared_ptr<const ClientParameters> parameters_;
+  td::ActorId<BotStatActor> stat_actor_;
+  ServerBotStat::WebhookState last_webhook_state_;
 
   double last_error_time_ = 0;
   td::string last_error_message_ = "<none>";
@@ -100,6 +105,7 @@ class WebhookActor final : public td::HttpOutboundConnection::Callback {
     td::TQueue::EventId id_;
     td::string json_;
     td::int32 expires_at_ = 0;
+    double load_time_ = 0;
     double last_send_time_ = 0;
     double wakeup_at_ = 0;
     int delay_ = 0;
@@ -133,6 +139,8 @@ class WebhookActor final : public td::HttpOutboundConnection::Callback {
     }
   };
   td::FlatHashMap<td::TQueue::EventId, td::unique_ptr<Update>, EventIdHash> update_map_;
+  td::int64 loaded_update_bytes_ = 0;
+  std::set<std::pair<double, td::int32>> update_load_times_;  // load time, event identifier
   td::FlatHashMap<td::int64, QueueUpdates> queue_updates_;
   std::set<Queue> queues_;
   td::int64 unique_queue_id_ = static_cast<td::int64>(1) << 60;
@@ -171,6 +179,7 @@ class WebhookActor final : public td::HttpOutboundConnection::Callback {
   td::int32 max_connections_ = 0;
   td::string secret_token_;
   td::Container<Connection> connections_;
+  td::int32 in_flight_update_count_ = 0;
   td::ListNode ready_connections_;
   td::FloodControlFast active_new_connection_flood_;
   td::FloodControlFast pending_new_connection_flood_;
@@ -198,10 +207,16 @@ class WebhookActor final : public td::HttpOutboundConnection::Callback {
 
   void load_updates();
   void on_update_ok(td::TQueue::EventId event_id);
-  void on_update_error(td::TQueue::EventId event_id, td::Slice error, int retry_after);
+  void on_update_error(td::TQueue::EventId event_id, td::Slice error, int retry_after,
+                       ServerBotStat::WebhookRetryCause cause);
   td::Status send_update() TD_WARN_UNUSED_RESULT;
   void send_updates();
 
+  template <class EventT>
+  void send_stat_event(const EventT &event);
+
+  void update_webhook_state();
+
   void loop() final;
   void handle(td::unique_ptr<td::HttpQuery> response) final;
 
@@ -10,6 +10,7 @@
 #include "telegram-bot-api/HttpServer.h"
 #include "telegram-bot-api/HttpStatConnection.h"
 #include "telegram-bot-api/Stats.h"
+#include "telegram-bot-api/UnixSocketListener.h"
 #include "telegram-bot-api/Watchdog.h"
 
 #include "td/db/binlog/Binlog.h"
@@ -32,6 +33,7 @@
 #include "td/utils/OptionParser.h"
 #include "td/utils/PathView.h"
 #include "td/utils/port/detail/ThreadIdGuard.h"
+#include "td/utils/port/FileFd.h"
 #include "td/utils/port/IPAddress.h"
 #include "td/utils/port/path.h"
 #include "td/utils/port/rlimit.h"
@@ -134,6 +136,28 @@ static void sigsegv_signal_handler(int signum, void *addr) {
   fail_signal_handler(signum);
 }
 
+static td::Result<double> parse_positive_seconds(td::Slice str) {
+  bool has_digit = false;
+  bool has_dot = false;
+  for (auto c : str) {
+    if (td::is_digit(c)) {
+      has_digit = true;
+    } else if (c == '.' && !has_dot) {
+      has_dot = true;
+    } else {
+      return td::Status::Error(PSLICE() << "Expected a number of seconds instead of \"" << str << '"');
+    }
+  }
+  if (!has_digit) {
+    return td::Status::Error(PSLICE() << "Expected a number of seconds instead of \"" << str << '"');
+  }
+  auto result = td::to_double(str);
+  if (result <= 0.0) {
+    return td::Status::Error("The number of seconds must be positive");
+  }
+  return result;
+}
+
 int main(int argc, char *argv[]) {
   SET_VERBOSITY_LEVEL(VERBOSITY_NAME(FATAL));
   td::ExitGuard exit_guard;
@@ -178,6 +202,8 @@ int main(int argc, char *argv[]) {
   int http_stat_port = 0;
   td::string http_ip_address = "0.0.0.0";
   td::string http_stat_ip_address = "0.0.0.0";
+  td::string http_unix_socket_path;
+  td::string http_stat_unix_socket_path;
   td::string log_file_path;
   int default_verbosity_level = 0;
   int memory_verbosity_level = VERBOSITY_NAME(INFO);
@@ -240,6 +266,41 @@ int main(int argc, char *argv[]) {
                                token_range = {rem_i, mod_i};
                                return td::Status::OK();
                              });
+  options.add_checked_option('\0', "query-trace-rate",
+                             "trace processing stages of one of every N API requests. Slow traces are shown on the "
+                             "statistics page with the \"traces\" argument. Tracing is disabled by default",
+                             td::OptionParser::parse_integer(shared_data->query_trace_rate_));
+  options.add_checked_option('\0', "slow-query-threshold",
+                             "trace all API requests and log the ones, which were processed longer than the specified "
+                             "number of seconds (e.g. 0.5). The slow query log is disabled by default",
+                             [&](td::Slice threshold) {
+                               TRY_RESULT_ASSIGN(shared_data->slow_query_threshold_,
+                                                 parse_positive_seconds(threshold));
+                               return td::Status::OK();
+                             });
+  options.add_option('\0', "cpu-time-stats",
+                     "measure CPU time spent by each bot and on JSON serialization. Requires a few system calls for "
+                     "each request and update",
+                     [&] { shared_data->need_cpu_time_stats_ = true; });
+  options.add_checked_option('\0', "max-scheduler-lag",
+                             "reject new requests with error 429 while the average event loop lag of the client "
+                             "thread exceeds the specified number of seconds (e.g. 0.1). Disabled by default",
+                             [&](td::Slice lag) {
+                               TRY_RESULT_ASSIGN(shared_data->max_client_scheduler_lag_, parse_positive_seconds(lag));
+                               return td::Status::OK();
+                             });
+  options.add_checked_option('\0', "max-pending-network-queries",
+                             "reject new requests with error 429 while the number of pending network queries exceeds "
+                             "the specified value. Disabled by default",
+                             td::OptionParser::parse_integer(shared_data->max_pending_network_query_count_));
+  options.add_checked_option('\0', "gzip-min-response-size",
+                             "minimum size of a response in bytes to be compressed with gzip if the client supports "
+                             "it. Responses are sent uncompressed by default",
+                             td::OptionParser::parse_integer(shared_data->min_compressed_response_size_));
+  options.add_option('\0', "capture-queries",
+                     "path to the file where anonymized descriptions of all incoming API requests will be written for "
+                     "later replay. Bot tokens and values of request parameters aren't saved",
+                     td::OptionParser::parse_string(parameters->query_capture_path_));
   options.add_checked_option('\0', "max-webhook-connections",
                              "default value of the maximum webhook connections per bot",
                              td::OptionParser::parse_integer(parameters->default_max_webhook_connections_));
@@ -259,6 +320,15 @@ int main(int argc, char *argv[]) {
                                http_stat_ip_address = ip_address.str();
                                return td::Status::OK();
                              });
+  if (UnixSocketListener::is_supported()) {
+    options.add_option('\0', "http-unix-socket",
+                       "path to a Unix domain socket, HTTP connections to which will be accepted in addition to TCP "
+                       "connections. Use --http-port=0 to accept only connections to the socket",
+                       td::OptionParser::parse_string(http_unix_socket_path));
+    options.add_option('\0', "http-stat-unix-socket",
+                       "path to a Unix domain socket, HTTP statistics connections to which will be accepted",
+                       td::OptionParser::parse_string(http_stat_unix_socket_path));
+  }
 
   options.add_option('l', "log", "path to the file where the log will be written",
                      td::OptionParser::parse_string(log_file_path));
@@ -304,6 +374,24 @@ int main(int argc, char *argv[]) {
     }
     return td::Status::OK();
   });
+  options.add_check([&] {
+    if (http_port == 0 && http_unix_socket_path.empty()) {
+      return td::Status::Error("HTTP port can be 0 only if a Unix socket is specified");
+    }
+    return td::Status::OK();
+  });
+  options.add_check([&] {
+    if (shared_data->query_trace_rate_ < 0) {
+      return td::Status::Error("Wrong query trace rate specified");
+    }
+    return td::Status::OK();
+  });
+  options.add_check([&] {
+    if (shared_data->slow_query_threshold_ < 0) {
+      return td::Status::Error("Wrong slow query threshold specified");
+    }
+    return td::Status::OK();
+  });
   options.add_check([&] {
     if (default_verbosity_level < 0) {
       return td::Status::Error("Wrong verbosity level specified");
@@ -431,6 +519,22 @@ int main(int argc, char *argv[]) {
       log.set_first(&file_log);
     }
 
+    if (!parameters->query_capture_path_.empty()) {
+      if (td::PathView(parameters->query_capture_path_).is_relative()) {
+        parameters->query_capture_path_ = working_directory + parameters->query_capture_path_;
+      }
+      TRY_RESULT_PREFIX(query_capture_fd,
+                        td::FileFd::open(parameters->query_capture_path_,
+                                         td::FileFd::Write | td::FileFd::Create | td::FileFd::Truncate),
+                        "Can't open query capture file: ");
+      query_capture_fd.close();
+    }
+    for (auto *path : {&http_unix_socket_path, &http_stat_unix_socket_path}) {
+      if (!path->empty() && td::PathView(*path).is_relative()) {
+        *path = working_directory + *path;
+      }
+    }
+
     return td::Status::OK();
   }();
   if (init_status.is_error()) {
@@ -472,25 +576,50 @@ int main(int argc, char *argv[]) {
                                                                 std::move(parameters), token_range)
                             .release();
 
-  sched
-      .create_actor_unsafe<HttpServer>(
-          SharedData::get_client_scheduler_id(), "HttpServer", http_ip_address, http_port,
-          [client_manager, shared_data] {
-            return td::ActorOwn<td::HttpInboundConnection::Callback>(
-                td::create_actor<HttpConnection>("HttpConnection", client_manager, shared_data));
-          })
-      .release();
+  if (http_port != 0) {
+    auto create_http_connection = [client_manager, shared_data] {
+      return td::ActorOwn<td::HttpInboundConnection::Callback>(
+          td::create_actor<HttpConnection>("HttpConnection", client_manager, shared_data, td::string()));
+    };
+    sched
+        .create_actor_unsafe<HttpServer>(SharedData::get_client_scheduler_id(), "HttpServer", http_ip_address,
+                                         http_port, create_http_connection)
+        .release();
+  }
+  if (!http_unix_socket_path.empty()) {
+    auto create_http_connection = [client_manager, shared_data](td::string peer) {
+      return td::ActorOwn<td::HttpInboundConnection::Callback>(
+          td::create_actor<HttpConnection>("HttpConnection", client_manager, shared_data, std::move(peer)));
+    };
+    sched
+        .create_actor_unsafe<HttpServer>(SharedData::get_client_scheduler_id(), "HttpUnixSocketServer",
+                                         http_unix_socket_path, create_http_connection)
+        .release();
+  }
 
+  auto create_http_stat_connection = [client_manager] {
+    return td::ActorOwn<td::HttpInboundConnection::Callback>(
+        td::create_actor<HttpStatConnection>("HttpStatConnection", client_manager));
+  };
   if (http_stat_port != 0) {
     sched
-        .create_actor_unsafe<HttpServer>(
-            SharedData::get_client_scheduler_id(), "HttpStatsServer", http_stat_ip_address, http_stat_port,
-            [client_manager] {
-              return td::ActorOwn<td::HttpInboundConnection::Callback>(
-                  td::create_actor<HttpStatConnection>("HttpStatConnection", client_manager));
-            })
+        .create_actor_unsafe<HttpServer>(SharedData::get_client_scheduler_id(), "HttpStatsServer",
+                                         http_stat_ip_address, http_stat_port, create_http_stat_connection)
         .release();
   }
+  if (!http_stat_unix_socket_path.empty()) {
+    auto create_unix_socket_http_stat_connection = [create_http_stat_connection](td::string) {
+      return create_http_stat_connection();
+    };
+    sched
+        .create_actor_unsafe<HttpServer>(SharedData::get_client_scheduler_id(), "HttpStatsUnixSocketServer",
+                                         http_stat_unix_socket_path, create_unix_socket_http_stat_connection)
+        .release();
+  }
+
+  for (td::int32 scheduler_id = 0; scheduler_id < SharedData::get_thread_count(); scheduler_id++) {
+    sched.create_actor_unsafe<SchedulerProbeActor>(scheduler_id, "SchedulerProbe", scheduler_id).release();
+  }
 
   constexpr double WATCHDOG_TIMEOUT = 0.25;
   auto watchdog_id = sched.create_actor_unsafe<Watchdog>(SharedData::get_watchdog_scheduler_id(), "Watchdog",